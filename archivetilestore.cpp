@@ -0,0 +1,517 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ctime>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+#include <zlib.h>
+#include <boost/filesystem.hpp>
+
+#include "archivetilestore.h"
+#include "pngoptimizer.h"
+
+namespace fs = boost::filesystem;
+
+using std::string;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+// index records: 'i', z, x, y, image id, offset, size, crc, md5, end of
+// the archive after it (54 bytes), for a tile written with its image, and
+// 't', z, x, y, image id, end (22 bytes) for a tile reusing one; numbers
+// are little endian
+static const int image_record = 54;
+static const int tile_record = 22;
+static const size_t index_magic_size = 8;
+
+static void put(char *p, uint64_t v, int bytes)
+{
+    for (int i=0; i<bytes; i++)
+        p[i] = char(v >> (8 * i));
+}
+
+static void put(string& s, uint64_t v, int bytes)
+{
+    char b[8];
+    put(b, v, bytes);
+    s.append(b, bytes);
+}
+
+static uint64_t get(const char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i=0; i<bytes; i++)
+        v |= uint64_t(uint8_t(p[i])) << (8 * i);
+    return v;
+}
+
+static string index_magic(ArchiveTileStore::Format format)
+{
+    return format == ArchiveTileStore::Format::tar ? "ATRTAR1\n" : "ATRZIP1\n";
+}
+
+static string tile_name(const tile& t)
+{
+    return std::to_string(t.z) + "/" + std::to_string(t.x) + "/" + std::to_string(t.y) + ".png";
+}
+
+// A ustar header for a regular file, or for a hard link to another entry
+static string tar_header(const string& name, uint64_t size, uint32_t mtime,
+                         const string& link = string())
+{
+    char h[512];
+    memset(h, 0, sizeof(h));
+    memcpy(h, name.data(), std::min(name.size(), size_t(100)));
+    snprintf(h + 100, 8, "%07o", 0644);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    snprintf(h + 124, 12, "%011llo", (unsigned long long) size);
+    snprintf(h + 136, 12, "%011llo", (unsigned long long) mtime);
+    h[156] = link.empty() ? '0' : '1';
+    memcpy(h + 157, link.data(), std::min(link.size(), size_t(100)));
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    // the checksum is computed with its own field as spaces
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (unsigned char c: h)
+        sum += c;
+    snprintf(h + 148, 8, "%06o", sum);
+    return string(h, sizeof(h));
+}
+
+ArchiveTileStore::ArchiveTileStore(const string &archive_file, bool verbose, size_t write_buffer)
+    : archive_file(archive_file), index_file(archive_file + ".index"), verbose(verbose),
+      queue(write_buffer)
+{
+    string ext = fs::path(archive_file).extension().string();
+    if (ext == ".tar")
+        format = Format::tar;
+    else if (ext == ".zip")
+        format = Format::zip;
+    else
+        throw std::runtime_error("Unknown archive format: " + archive_file + " (use .tar or .zip)");
+
+    time_t now = time(nullptr);
+    mtime = now;
+    struct tm local;
+    localtime_r(&now, &local);
+    dos_time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+    dos_date = ((std::max(local.tm_year, 80) - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+
+    if (!fs::exists(archive_file))
+        create();
+    else if (fs::exists(index_file))
+        resume();
+    else
+        throw std::runtime_error(archive_file + " is complete (there's no " + index_file +
+                                 " to resume from); remove it to render it again");
+    setvbuf(archive, nullptr, _IOFBF, 1 << 20);
+
+    write_thread = std::thread([this]() {
+        write_loop();
+    });
+}
+
+ArchiveTileStore::~ArchiveTileStore()
+{
+    close();
+}
+
+void ArchiveTileStore::create()
+{
+    archive = fopen(archive_file.c_str(), "wb");
+    if (!archive)
+        throw std::runtime_error("Error creating " + archive_file + ": " + strerror(errno));
+    index = fopen(index_file.c_str(), "wb");
+    if (!index)
+        throw std::runtime_error("Error creating " + index_file + ": " + strerror(errno));
+    string magic = index_magic(format);
+    fwrite(magic.data(), 1, magic.size(), index);
+}
+
+// Reads the index back. Records are written after their entries, but the
+// index and the archive may have been flushed at different times, so
+// everything from the first record past the end of the archive on disk
+// is dropped, and both files are cut where the good part ends (which also
+// drops the end of a finished archive).
+void ArchiveTileStore::resume()
+{
+    if (verbose) cout << "Loading rendered tiles from " << index_file << "... ";
+
+    uint64_t size = fs::file_size(archive_file);
+    std::ifstream in(index_file, std::ios::binary);
+    char r[image_record];
+    string magic = index_magic(format);
+    if (!in.read(r, index_magic_size) || string(r, index_magic_size) != magic)
+        throw std::runtime_error(index_file + " isn't the index of a " +
+                                 (format == Format::tar ? "tar" : "zip") + " file");
+    uint64_t good = index_magic_size;
+    int max_id = -1;
+    while (in.get(r[0])) {
+        bool new_image = r[0] == 'i';
+        if (!new_image && r[0] != 't')
+            break;
+        if (!in.read(r + 1, (new_image ? image_record : tile_record) - 1))
+            break;
+        tile t { int(get(r + 2, 4)), int(get(r + 6, 4)), uint8_t(r[1]) };
+        int id = get(r + 10, 4);
+        uint64_t end = get(r + (new_image ? 46 : 14), 8);
+        if (t.z > 31 || id < 0 || end > size)
+            break;
+        if (new_image) {
+            image img { t, get(r + 14, 8), uint32_t(get(r + 22, 4)), uint32_t(get(r + 26, 4)) };
+            md5digest digest;
+            memcpy(&digest, r + 30, sizeof(digest));
+            if (size_t(id) >= images.size())
+                images.resize(id + 1, image { tile { 0, 0, 0 }, 0, 0, 0 });
+            images[id] = img;
+            idmap.insert(digest, id);
+            max_id = std::max(max_id, id);
+        } else if (size_t(id) >= images.size() || images[id].size == 0) {
+            break;
+        }
+        if (format == Format::zip)
+            entries.push_back(entry { t, id });
+        rendered_tiles.insert(t);
+        archive_size = end;
+        good += new_image ? image_record : tile_record;
+    }
+    in.close();
+    next_image_id = max_id + 1;
+
+    if (truncate(index_file.c_str(), good) != 0 ||
+            truncate(archive_file.c_str(), archive_size) != 0)
+        throw std::runtime_error("Error truncating " + archive_file + ": " + strerror(errno));
+
+    archive = fopen(archive_file.c_str(), "ab");
+    if (!archive)
+        throw std::runtime_error("Error opening " + archive_file + ": " + strerror(errno));
+    index = fopen(index_file.c_str(), "ab");
+    if (!index)
+        throw std::runtime_error("Error opening " + index_file + ": " + strerror(errno));
+
+    if (verbose) cout << "done (" << rendered_tiles.size() << " tiles)." << endl;
+}
+
+bool ArchiveTileStore::alreadyRendered(const tile &t)
+{
+    return rendered_tiles.contains(t);
+}
+
+void ArchiveTileStore::storeTile(const tile &t, string &&data, const rawhash &raw)
+{
+    md5digest digest = md5_digest(data);
+
+    IdMap::entry image;
+    if (idmap.find_or_add(digest, next_image_id, image)) {
+        if (image.pending) {
+            lock_guard<mutex> guard { pending_mutex };
+            // look again now that it can't change: it may have been
+            // stored, or dropped, in the meantime
+            if (!idmap.find(digest, image)) {
+                storeTile(t, std::move(data), raw);
+                return;
+            }
+            if (image.pending) {
+                // The image is still being postprocessed, this tile will
+                // be queued right after it.
+                pending[digest].push_back(t);
+                return;
+            }
+        }
+        remember(raw, digest, image.id);
+        enqueue(t, image.id, "", "");
+        return;
+    }
+
+    _unique_tiles++;
+    int id = image.id;
+    process(std::move(data), hexdigest(digest), [this, t, id, digest, raw](string&& d) {
+        // the image is queued before any tile can link to it
+        if (!d.empty())
+            enqueue(t, id, d, string(reinterpret_cast<const char *>(&digest), sizeof(digest)));
+        std::vector<tile> waiting;
+        {
+            lock_guard<mutex> guard { pending_mutex };
+            auto p = pending.find(digest);
+            if (p != pending.end()) {
+                waiting.swap(p->second);
+                pending.erase(p);
+            }
+            if (d.empty()) {
+                // forget it, so the next tile with this image tries again
+                idmap.erase(digest);
+                _unique_tiles--;
+                return;
+            }
+            idmap.set_ready(digest);
+        }
+        remember(raw, digest, id);
+        for (const tile& w: waiting)
+            enqueue(w, id, "", "");
+    });
+}
+
+bool ArchiveTileStore::storeExisting(const tile &t, const stored_image &image)
+{
+    enqueue(t, image.id, "", "");
+    return true;
+}
+
+void ArchiveTileStore::enqueue(const tile &t, int id, const string &data, const string &hash)
+{
+    // waits here while the queue is full, which slows rendering down to
+    // the writer's pace
+    double waited = queue.push(t, id, data, hash);
+    if (waited > 0)
+        stall_ns += uint64_t(waited * 1e9);
+    // taking the lock makes sure the writer is either waiting or hasn't
+    // checked the queue yet, so the notification isn't lost
+    lock_guard<mutex> write_cond_guard { write_cond_m };
+    write_cond.notify_one();
+}
+
+bool ArchiveTileStore::write_queue(long &entries, size_t &bytes, double &stalled) const
+{
+    entries = queue.size();
+    bytes = queue.bytes();
+    stalled = stall_ns.load() / 1e9;
+    return true;
+}
+
+bool ArchiveTileStore::finished()
+{
+    return TileStore::finished() && queue.empty();
+}
+
+void ArchiveTileStore::write_loop()
+{
+    std::vector<InsertOp> batch;
+    while (true) {
+        if (queue.take(batch, 1024) > 0) {
+            for (const InsertOp& op: batch)
+                write(op);
+            batch.clear();
+            queue.release();
+            continue;
+        }
+
+        unique_lock<mutex> lock(write_cond_m);
+        write_cond.wait(lock, [this]() { return closing || !queue.empty(); });
+        if (closing && queue.empty())
+            break;
+    }
+}
+
+void ArchiveTileStore::append(const char *data, size_t size)
+{
+    if (fwrite(data, 1, size, archive) != size && !write_failed) {
+        perror(("Error writing to " + archive_file).c_str());
+        write_failed = true;
+    }
+    archive_size += size;
+}
+
+void ArchiveTileStore::append(const string &data)
+{
+    append(data.data(), data.size());
+}
+
+void ArchiveTileStore::write(const InsertOp &op)
+{
+    string name = tile_name(op.t);
+    char r[image_record];
+    r[1] = char(op.t.z);
+    put(r + 2, op.t.x, 4);
+    put(r + 6, op.t.y, 4);
+    put(r + 10, op.id, 4);
+
+    if (op.data_size > 0) {
+        image img { op.t, archive_size, uint32_t(op.data_size),
+                    uint32_t(crc32(0, reinterpret_cast<const Bytef *>(op.data), op.data_size)) };
+        if (format == Format::tar) {
+            append(tar_header(name, img.size, mtime));
+            append(op.data, op.data_size);
+            // entries take whole 512 byte blocks
+            static const char zeros[512] = {};
+            append(zeros, (512 - img.size % 512) % 512);
+        } else {
+            string h;
+            put(h, 0x04034b50, 4);  // local file header
+            put(h, 20, 2);          // version needed: 2.0
+            put(h, 0, 2);           // flags
+            put(h, 0, 2);           // stored
+            put(h, dos_time, 2);
+            put(h, dos_date, 2);
+            put(h, img.crc, 4);
+            put(h, img.size, 4);
+            put(h, img.size, 4);
+            put(h, name.size(), 2);
+            put(h, 0, 2);           // extra field length
+            h += name;
+            append(h);
+            append(op.data, op.data_size);
+        }
+        if (size_t(op.id) >= images.size())
+            images.resize(op.id + 1, image { tile { 0, 0, 0 }, 0, 0, 0 });
+        images[op.id] = img;
+
+        r[0] = 'i';
+        put(r + 14, img.offset, 8);
+        put(r + 22, img.size, 4);
+        put(r + 26, img.crc, 4);
+        memcpy(r + 30, op.hash, op.hash_size);
+        put(r + 46, archive_size, 8);
+    } else {
+        if (size_t(op.id) >= images.size() || images[op.id].size == 0) {
+            cerr << "Error storing " << op.t << ": its image wasn't written" << endl;
+            return;
+        }
+        // a zip entry pointing at an existing one is all central directory
+        if (format == Format::tar)
+            append(tar_header(name, 0, mtime, tile_name(images[op.id].first)));
+        r[0] = 't';
+        put(r + 14, archive_size, 8);
+    }
+
+    if (format == Format::zip)
+        entries.push_back(entry { op.t, op.id });
+    size_t size = r[0] == 'i' ? image_record : tile_record;
+    if (fwrite(r, 1, size, index) != size)
+        perror(("Error writing to " + index_file).c_str());
+}
+
+void ArchiveTileStore::close()
+{
+    if (!archive)
+        return;
+
+    // images still being optimized are queued before the writer stops
+    if (_optimizer)
+        _optimizer->drain();
+    if (write_thread.joinable()) {
+        {
+            lock_guard<mutex> write_cond_guard { write_cond_m };
+            closing = true;
+        }
+        write_cond.notify_one();
+        write_thread.join();
+    }
+
+    if (verbose) cout << "Finishing " << archive_file << "... " << std::flush;
+    write_trailer();
+    bool ok = !write_failed && fflush(archive) == 0 && fsync(fileno(archive)) == 0;
+    ok = fclose(archive) == 0 && ok;
+    archive = nullptr;
+    fclose(index);
+    index = nullptr;
+
+    if (!ok) {
+        // the index stays, a new run finishes the archive
+        cerr << "Error writing " << archive_file << ": " << strerror(errno) << endl;
+        return;
+    }
+    fs::remove(index_file);
+
+    if (verbose) cout << "done." << endl;
+}
+
+void ArchiveTileStore::write_trailer()
+{
+    if (format == Format::tar) {
+        // two empty blocks
+        append(string(1024, '\0'));
+        return;
+    }
+    write_central_directory();
+}
+
+// Entries sharing an image share its local header. Offsets and counts
+// that don't fit the classic fields go in zip64 records.
+void ArchiveTileStore::write_central_directory()
+{
+    const uint64_t max32 = 0xffffffff;
+    uint64_t start = archive_size;
+    string h;
+    for (const entry& e: entries) {
+        const image& img = images[e.id];
+        string name = tile_name(e.t);
+        bool zip64 = img.offset >= max32;
+        h.clear();
+        put(h, 0x02014b50, 4);           // central directory header
+        put(h, (3 << 8) | 45, 2);        // made by: unix, 4.5
+        put(h, zip64 ? 45 : 20, 2);      // version needed
+        put(h, 0, 2);                    // flags
+        put(h, 0, 2);                    // stored
+        put(h, dos_time, 2);
+        put(h, dos_date, 2);
+        put(h, img.crc, 4);
+        put(h, img.size, 4);
+        put(h, img.size, 4);
+        put(h, name.size(), 2);
+        put(h, zip64 ? 12 : 0, 2);       // extra field length
+        put(h, 0, 2);                    // comment length
+        put(h, 0, 2);                    // disk
+        put(h, 0, 2);                    // internal attributes
+        put(h, uint32_t(0100644) << 16, 4);
+        put(h, std::min(img.offset, max32), 4);
+        h += name;
+        if (zip64) {
+            put(h, 0x0001, 2);
+            put(h, 8, 2);
+            put(h, img.offset, 8);
+        }
+        append(h);
+    }
+    uint64_t length = archive_size - start;
+    uint64_t count = entries.size();
+
+    h.clear();
+    if (count >= 0xffff || start >= max32 || length >= max32) {
+        uint64_t zip64_end = archive_size;
+        put(h, 0x06064b50, 4);           // zip64 end of central directory
+        put(h, 44, 8);
+        put(h, (3 << 8) | 45, 2);
+        put(h, 45, 2);
+        put(h, 0, 4);
+        put(h, 0, 4);
+        put(h, count, 8);
+        put(h, count, 8);
+        put(h, length, 8);
+        put(h, start, 8);
+        put(h, 0x07064b50, 4);           // its locator
+        put(h, 0, 4);
+        put(h, zip64_end, 8);
+        put(h, 1, 4);
+    }
+    put(h, 0x06054b50, 4);               // end of central directory
+    put(h, 0, 2);
+    put(h, 0, 2);
+    put(h, std::min(count, uint64_t(0xffff)), 2);
+    put(h, std::min(count, uint64_t(0xffff)), 2);
+    put(h, std::min(length, max32), 4);
+    put(h, std::min(start, max32), 4);
+    put(h, 0, 2);
+    append(h);
+}
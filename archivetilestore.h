@@ -0,0 +1,124 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef ARCHIVETILESTORE_H
+#define ARCHIVETILESTORE_H
+
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "tilestore.h"
+#include "tileindex.h"
+#include "idmap.h"
+#include "writequeue.h"
+
+/* Saves tiles into a single uncompressed tar, or a zip with stored
+ * (uncompressed) entries, named z/x/y.png, so they can be shipped without
+ * writing a file per tile first.
+ *
+ * Entries are streamed by one writer thread from a bounded queue. Each
+ * distinct image is written once, with its first tile; later tiles with
+ * the same image are hard links to it in a tar, and zip central directory
+ * records pointing at its local header in a zip (so zip readers that
+ * check the local header's name against the central directory's will
+ * refuse those).
+ *
+ * Every entry written is recorded in FILE.index; an interrupted run
+ * resumes from it. The end of archive (and the zip central directory)
+ * is written when closing, and the index is then removed.
+ */
+class ArchiveTileStore : public TileStore {
+    public:
+        enum class Format { tar, zip };
+
+        // The format comes from the file's extension, .tar or .zip.
+        ArchiveTileStore(const std::string& archive_file, bool verbose = false,
+                         size_t write_buffer = size_t(1) << 30);
+        ~ArchiveTileStore();
+        bool alreadyRendered(const tile &t) override;
+        void storeTile(const tile &t, std::string &&data, const rawhash& raw) override;
+        int unique_tiles() override { return _unique_tiles; }
+        void close() override;
+        bool finished() override;
+        bool write_queue(long& entries, size_t& bytes, double& stalled) const override;
+
+    protected:
+        bool storeExisting(const tile& t, const stored_image& image) override;
+
+    private:
+        // an image's entry, and what zip needs to point more entries at it
+        struct image {
+            tile first;
+            uint64_t offset;
+            uint32_t size;
+            uint32_t crc;
+        };
+        struct entry {
+            tile t;
+            int id;
+        };
+
+        void create();
+        void resume();
+        void enqueue(const tile& t, int id, const std::string& data, const std::string& hash);
+        void write_loop();
+        void write(const InsertOp& op);
+        void write_trailer();
+        void write_central_directory();
+        void append(const std::string& data);
+        void append(const char *data, size_t size);
+
+        std::string archive_file;
+        std::string index_file;
+        Format format;
+        bool verbose;
+        IdMap idmap;
+        // images being postprocessed, and the tiles waiting for them
+        std::unordered_map<md5digest,std::vector<tile>> pending;
+        std::mutex pending_mutex;
+
+        TileIndex rendered_tiles;
+
+        std::atomic_int _unique_tiles {0};
+        std::atomic_int next_image_id { 0 };
+        std::atomic<uint64_t> stall_ns { 0 };
+
+        WriteQueue queue;
+        bool closing = false;
+        std::thread write_thread;
+        std::condition_variable write_cond;
+        std::mutex write_cond_m;
+
+        // used by the writer thread only, once it's started
+        FILE *archive = nullptr;
+        FILE *index = nullptr;
+        uint64_t archive_size = 0;
+        bool write_failed = false;
+        // indexed by image id; ids of images that failed are never used
+        std::vector<image> images;
+        // every entry, for the zip central directory
+        std::vector<entry> entries;
+        // when entries are written, for tar and in DOS format for zip
+        uint32_t mtime;
+        uint16_t dos_time, dos_date;
+};
+
+#endif // ARCHIVETILESTORE_H
@@ -0,0 +1,44 @@
+#!/usr/bin/python3
+
+# This benchmarking script is licensed under the terms
+# of the MIT license
+# Copyright (c) 2016 Andy Teijelo <github.com/ateijelo>
+
+# Renders the same tile list once per scheduling order, each time into a
+# fresh temporary directory, and reports the throughput of each run.
+#
+# usage: bench_order.py ATRENDER STYLE.xml TILES.txt [extra atrender args...]
+
+from subprocess import run, PIPE
+import re
+import shutil
+import sys
+import tempfile
+
+def bench(atrender, style, tiles, order, extra):
+    out = tempfile.mkdtemp(prefix="atrender-bench-")
+    try:
+        p = run([atrender, "-x", style, "-d", out, "--order", order] + extra + [tiles],
+                stdout=PIPE, stderr=PIPE, universal_newlines=True)
+        if p.returncode != 0:
+            sys.stderr.write(p.stderr)
+            sys.exit("atrender failed with status {}".format(p.returncode))
+        m = re.search(r"Rendered (\d+) tiles in (\S+) \(([\d.]+) tiles/s", p.stdout)
+        if m is None:
+            sys.exit("couldn't find the summary line in atrender's output")
+        return int(m.group(1)), m.group(2), float(m.group(3))
+    finally:
+        shutil.rmtree(out)
+
+if __name__ == "__main__":
+    if len(sys.argv) < 4:
+        sys.exit("usage: {} ATRENDER STYLE.xml TILES.txt [atrender args...]".format(sys.argv[0]))
+    atrender, style, tiles = sys.argv[1:4]
+    extra = sys.argv[4:]
+    results = {}
+    for order in ["shuffle", "hilbert"]:
+        n, elapsed, speed = bench(atrender, style, tiles, order, extra)
+        results[order] = speed
+        print("{:8} {:>10} tiles  {}  {:8.1f} tiles/s".format(order, n, elapsed, speed))
+    if results["shuffle"] > 0:
+        print("hilbert/shuffle speedup: {:.2f}x".format(results["hilbert"] / results["shuffle"]))
@@ -0,0 +1,115 @@
+#!/usr/bin/python3
+
+# This benchmarking script is licensed under the terms
+# of the MIT license
+# Copyright (c) 2016 Andy Teijelo <github.com/ateijelo>
+
+# Measures how long a tile server would wait on the disk while a user pans
+# a map over an MBTiles file, before and after reorganizing it with
+# --finalize hilbert. The reorganized file is a temporary copy; the
+# original isn't modified.
+#
+# The viewport (8x5 tiles, about a 1920x1080 screen) sweeps the zoom level
+# back and forth one column at a time, like a lawnmower; at each step the
+# tiles that come into view are read. The file is dropped from the page
+# cache before each pan starts, so reads go to the disk until the pages
+# they need have been read once.
+#
+# usage: bench_pan.py ATRENDER FILE.mbtiles [ZOOM [STEPS]]
+
+from subprocess import run, PIPE
+import os
+import shutil
+import sqlite3
+import sys
+import tempfile
+import time
+
+VIEW_W, VIEW_H = 8, 5
+
+def drop_cache(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+def pan_path(db, zoom, steps):
+    minx, maxx, miny, maxy = db.execute(
+        "SELECT MIN(tile_column), MAX(tile_column), MIN(tile_row), MAX(tile_row) "
+        "FROM tiles WHERE zoom_level = ?", (zoom,)).fetchone()
+    if minx is None:
+        sys.exit("there are no tiles at zoom level {}".format(zoom))
+    # top left corners of the viewport
+    path = []
+    y = max(miny, maxy - VIEW_H + 1)
+    x, dx = minx, 1
+    while len(path) < steps:
+        path.append((x, y))
+        if minx <= x + dx <= max(minx, maxx - VIEW_W + 1):
+            x += dx
+        else:
+            # next row of viewports, panning the other way
+            dx = -dx
+            y -= VIEW_H
+            if y < miny - VIEW_H + 1:
+                break
+    return path
+
+def view(x, y):
+    return {(x + i, y - j) for i in range(VIEW_W) for j in range(VIEW_H)}
+
+def pan(path, zoom, steps):
+    drop_cache(path)
+    db = sqlite3.connect("file:{}?mode=ro".format(path), uri=True)
+    query = "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?"
+    latencies = []
+    tiles = 0
+    shown = set()
+    for x, y in pan_path(db, zoom, steps):
+        new = view(x, y) - shown
+        start = time.perf_counter()
+        for col, row in sorted(new):
+            db.execute(query, (zoom, col, row)).fetchone()
+        latencies.append(time.perf_counter() - start)
+        tiles += len(new)
+        shown = view(x, y)
+    db.close()
+    return tiles, latencies
+
+def report(name, tiles, latencies):
+    l = sorted(latencies)
+    ms = lambda s: s * 1000
+    print("{:7} {:5} steps {:7} tiles  mean {:7.2f} ms  p50 {:7.2f} ms  p95 {:7.2f} ms  total {:8.1f} ms".format(
+          name, len(l), tiles, ms(sum(l) / len(l)), ms(l[len(l) // 2]),
+          ms(l[min(len(l) - 1, len(l) * 95 // 100)]), ms(sum(l))))
+    return l[min(len(l) - 1, len(l) * 95 // 100)], sum(l)
+
+if __name__ == "__main__":
+    if len(sys.argv) < 3:
+        sys.exit("usage: {} ATRENDER FILE.mbtiles [ZOOM [STEPS]]".format(sys.argv[0]))
+    atrender, mbtiles = sys.argv[1:3]
+    db = sqlite3.connect("file:{}?mode=ro".format(mbtiles), uri=True)
+    zoom = int(sys.argv[3]) if len(sys.argv) > 3 else db.execute("SELECT MAX(zoom_level) FROM tiles").fetchone()[0]
+    steps = int(sys.argv[4]) if len(sys.argv) > 4 else 500
+    db.close()
+
+    tmp = tempfile.mkdtemp(prefix="atrender-bench-", dir=os.path.dirname(os.path.abspath(mbtiles)))
+    try:
+        after = os.path.join(tmp, "after.mbtiles")
+        shutil.copyfile(mbtiles, after)
+        p = run([atrender, "-m", after, "--merge", "--finalize", "hilbert"],
+                stdout=PIPE, stderr=PIPE, universal_newlines=True)
+        if p.returncode != 0:
+            sys.stderr.write(p.stderr)
+            sys.exit("atrender failed with status {}".format(p.returncode))
+
+        print("zoom {}, {}x{} tile viewport".format(zoom, VIEW_W, VIEW_H))
+        p95_before, total_before = report("before", *pan(mbtiles, zoom, steps))
+        p95_after, total_after = report("after", *pan(after, zoom, steps))
+        if total_after > 0 and p95_after > 0:
+            print("after/before speedup: {:.2f}x total, {:.2f}x p95".format(
+                  total_before / total_after, p95_before / p95_after))
+    finally:
+        shutil.rmtree(tmp)
@@ -0,0 +1,247 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "coprocess.h"
+
+extern char **environ;
+
+// A coprocess that takes longer than this to take a tile and answer is
+// considered hung
+static const std::chrono::seconds timeout(60);
+
+using std::string;
+using std::cerr;
+using std::endl;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+CoprocessPool::CoprocessPool(const string &command, int size)
+    : command(command), pool(std::max(1, size))
+{
+    // a coprocess dying while we write to it must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    for (size_t i=0; i<pool.size(); i++) {
+        start(pool[i]);
+        idle.push_back(i);
+    }
+}
+
+CoprocessPool::~CoprocessPool()
+{
+    for (coprocess& c: pool)
+        stop(c);
+}
+
+// posix_spawn instead of fork, since coprocesses may be restarted while
+// the render threads are running.
+void CoprocessPool::start(coprocess &c)
+{
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) != 0)
+        throw std::runtime_error(string("Error creating pipe: ") + strerror(errno));
+    if (pipe2(from_child, O_CLOEXEC) != 0) {
+        ::close(to_child[0]);
+        ::close(to_child[1]);
+        throw std::runtime_error(string("Error creating pipe: ") + strerror(errno));
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_child[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, from_child[1], 1);
+    // in a process group of its own, so a hung command can be killed
+    // along with whatever the shell started
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    const char *argv[] = { "/bin/sh", "-c", command.c_str(), nullptr };
+    pid_t pid;
+    int rc = posix_spawn(&pid, "/bin/sh", &actions, &attr,
+                         const_cast<char **>(argv), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(to_child[0]);
+    ::close(from_child[1]);
+    if (rc != 0) {
+        ::close(to_child[1]);
+        ::close(from_child[0]);
+        throw std::runtime_error("Error starting " + command + ": " + strerror(rc));
+    }
+
+    c.pid = pid;
+    c.in = to_child[1];
+    c.out = from_child[0];
+    // reads and writes wait in poll(), with a deadline
+    fcntl(c.in, F_SETFL, fcntl(c.in, F_GETFL) | O_NONBLOCK);
+    fcntl(c.out, F_SETFL, fcntl(c.out, F_GETFL) | O_NONBLOCK);
+}
+
+void CoprocessPool::stop(coprocess &c, bool hung)
+{
+    if (c.pid < 0)
+        return;
+    if (hung)
+        kill(-c.pid, SIGKILL);
+    // closing its input tells the coprocess we're done; if it doesn't
+    // exit within the timeout it's killed
+    ::close(c.in);
+    ::close(c.out);
+    auto until = std::chrono::steady_clock::now() + timeout;
+    int status;
+    while (waitpid(c.pid, &status, WNOHANG) == 0) {
+        if (std::chrono::steady_clock::now() >= until) {
+            kill(-c.pid, SIGKILL);
+            waitpid(c.pid, &status, 0);
+            break;
+        }
+        usleep(10000);
+    }
+    c.pid = -1;
+}
+
+typedef std::chrono::steady_clock::time_point deadline;
+
+// Waits until fd is ready for events, or returns false at the deadline
+static bool wait_for(int fd, short events, deadline until)
+{
+    while (true) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        until - std::chrono::steady_clock::now()).count();
+        if (left <= 0)
+            return false;
+        pollfd p { fd, events, 0 };
+        int r = poll(&p, 1, int(left));
+        if (r < 0 && errno == EINTR)
+            continue;
+        // errors and hangups show up in the read or write that follows
+        return r > 0;
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t size, deadline until)
+{
+    while (size > 0) {
+        ssize_t r = write(fd, data, size);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN) {
+            if (!wait_for(fd, POLLOUT, until))
+                return false;
+            continue;
+        }
+        if (r <= 0)
+            return false;
+        data += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *data, size_t size, deadline until)
+{
+    while (size > 0) {
+        ssize_t r = read(fd, data, size);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN) {
+            if (!wait_for(fd, POLLIN, until))
+                return false;
+            continue;
+        }
+        if (r <= 0)
+            return false;
+        data += r;
+        size -= r;
+    }
+    return true;
+}
+
+bool CoprocessPool::exchange(coprocess &c, const string &data, string &result)
+{
+    deadline until = std::chrono::steady_clock::now() + timeout;
+    unsigned char header[4];
+    uint32_t size = data.size();
+    for (int i=0; i<4; i++)
+        header[i] = (size >> (24 - 8 * i)) & 0xff;
+    if (!write_all(c.in, reinterpret_cast<const char *>(header), 4, until) ||
+            !write_all(c.in, data.data(), data.size(), until))
+        return false;
+
+    if (!read_all(c.out, reinterpret_cast<char *>(header), 4, until))
+        return false;
+    size = 0;
+    for (int i=0; i<4; i++)
+        size = (size << 8) | header[i];
+    result.resize(size);
+    return read_all(c.out, &result[0], size, until);
+}
+
+string CoprocessPool::process(const string &data)
+{
+    size_t i;
+    {
+        unique_lock<mutex> lock(idle_mutex);
+        idle_cond.wait(lock, [this]() { return !idle.empty(); });
+        i = idle.back();
+        idle.pop_back();
+    }
+
+    coprocess& c = pool[i];
+    string result;
+    if (c.pid < 0) {
+        // it couldn't be restarted last time, try again
+        try {
+            start(c);
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
+        }
+    }
+    if (c.pid >= 0 && !exchange(c, data, result)) {
+        cerr << "Postprocessing command " << command << " (pid " << c.pid
+             << ") stopped responding, restarting it" << endl;
+        result.clear();
+        stop(c, true);
+        try {
+            start(c);
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(idle_mutex);
+        idle.push_back(i);
+    }
+    idle_cond.notify_one();
+    return result;
+}
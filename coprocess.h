@@ -0,0 +1,62 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COPROCESS_H
+#define COPROCESS_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <condition_variable>
+
+#include <sys/types.h>
+
+/* A pool of long-lived postprocessing commands. Each command is started
+ * once (through /bin/sh) and then handles any number of tiles: it reads
+ * a 4 byte big-endian length followed by that many bytes of PNG data on
+ * its standard input, and answers the same way on its standard output.
+ * An answer of length 0 means the tile couldn't be processed.
+ *
+ * A coprocess that dies, or takes longer than a timeout over a tile, is
+ * killed and restarted for the next tile.
+ */
+class CoprocessPool {
+    public:
+        CoprocessPool(const std::string& command, int size);
+        ~CoprocessPool();
+        // Sends data to an idle coprocess and returns its answer, or an
+        // empty string on errors. Blocks while every coprocess is busy.
+        std::string process(const std::string& data);
+
+    private:
+        struct coprocess {
+            pid_t pid = -1;
+            int in = -1;   // its standard input
+            int out = -1;  // its standard output
+        };
+        void start(coprocess& c);
+        // Stops c, killing it (and anything it started) if it's hung
+        void stop(coprocess& c, bool hung = false);
+        bool exchange(coprocess& c, const std::string& data, std::string& result);
+
+        std::string command;
+        std::vector<coprocess> pool;
+        std::vector<size_t> idle;
+        std::mutex idle_mutex;
+        std::condition_variable idle_cond;
+};
+
+#endif // COPROCESS_H
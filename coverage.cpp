@@ -0,0 +1,306 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cmath>
+#include <climits>
+#include <stdexcept>
+#include <algorithm>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "coverage.h"
+
+namespace pt = boost::property_tree;
+
+using std::string;
+using std::vector;
+
+typedef CoverageTileSource::point point;
+typedef CoverageTileSource::segment segment;
+
+#define MAX_LATITUDE 85.0511287798
+
+// Web Mercator tile space: the whole world is the unit square, with y
+// growing southwards like tile rows do.
+static double lon2x(double lon)
+{
+    return (lon + 180.0) / 360.0;
+}
+
+static double lat2y(double lat)
+{
+    lat = std::max(-MAX_LATITUDE, std::min(MAX_LATITUDE, lat));
+    double r = lat * M_PI / 180.0;
+    return (1.0 - std::log(std::tan(r) + 1.0 / std::cos(r)) / M_PI) / 2.0;
+}
+
+static void add_ring(const pt::ptree& ring, vector<segment>& edges)
+{
+    vector<point> points;
+    for (const auto& c: ring) {
+        auto i = c.second.begin();
+        if (c.second.size() < 2)
+            throw std::runtime_error("invalid GeoJSON coordinates");
+        double lon = (i++)->second.get_value<double>();
+        double lat = i->second.get_value<double>();
+        points.push_back({ lon2x(lon), lat2y(lat) });
+    }
+    if (points.size() < 3)
+        return;
+    for (size_t i=0; i<points.size(); i++) {
+        const point& a = points[i];
+        const point& b = points[(i + 1) % points.size()];
+        if (a.x != b.x || a.y != b.y)
+            edges.push_back({ a, b });
+    }
+}
+
+static void add_geometry(const pt::ptree& g, vector<segment>& edges)
+{
+    string type = g.get<string>("type", "");
+    if (type == "Polygon") {
+        for (const auto& ring: g.get_child("coordinates"))
+            add_ring(ring.second, edges);
+    } else if (type == "MultiPolygon") {
+        for (const auto& polygon: g.get_child("coordinates"))
+            for (const auto& ring: polygon.second)
+                add_ring(ring.second, edges);
+    } else if (type == "GeometryCollection") {
+        for (const auto& child: g.get_child("geometries"))
+            add_geometry(child.second, edges);
+    } else if (type == "Feature") {
+        add_geometry(g.get_child("geometry"), edges);
+    } else if (type == "FeatureCollection") {
+        for (const auto& feature: g.get_child("features"))
+            add_geometry(feature.second, edges);
+    }
+    // other geometry types don't cover any area
+}
+
+// Liang-Barsky: does the segment touch the closed box?
+static bool intersects(const segment& s, double x0, double y0, double x1, double y1)
+{
+    double t0 = 0, t1 = 1;
+    double dx = s.b.x - s.a.x;
+    double dy = s.b.y - s.a.y;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { s.a.x - x0, x1 - s.a.x, s.a.y - y0, y1 - s.a.y };
+    for (int i=0; i<4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0)
+                return false;
+        } else {
+            double r = q[i] / p[i];
+            if (p[i] < 0) {
+                if (r > t1) return false;
+                if (r > t0) t0 = r;
+            } else {
+                if (r < t0) return false;
+                if (r < t1) t1 = r;
+            }
+        }
+    }
+    return true;
+}
+
+// Parity of the edges crossed going from (x0,y) to (x1,y), x0 <= x1.
+static bool crossings_h(const vector<segment>& edges, double x0, double x1, double y)
+{
+    bool odd = false;
+    for (const segment& s: edges) {
+        if ((s.a.y > y) == (s.b.y > y))
+            continue;
+        double x = s.a.x + (y - s.a.y) * (s.b.x - s.a.x) / (s.b.y - s.a.y);
+        if (x0 < x && x <= x1)
+            odd = !odd;
+    }
+    return odd;
+}
+
+// Parity of the edges crossed going from (x,y0) to (x,y1), y0 <= y1.
+static bool crossings_v(const vector<segment>& edges, double x, double y0, double y1)
+{
+    bool odd = false;
+    for (const segment& s: edges) {
+        if ((s.a.x > x) == (s.b.x > x))
+            continue;
+        double y = s.a.y + (x - s.a.x) * (s.b.y - s.a.y) / (s.b.x - s.a.x);
+        if (y0 < y && y <= y1)
+            odd = !odd;
+    }
+    return odd;
+}
+
+// Does the box [a0,a1] overlap [b0,b1]? A degenerate [b0,b1] overlaps the
+// boxes that contain it, so a bounding box can be a single point.
+static bool overlaps(double a0, double a1, double b0, double b1)
+{
+    if (b0 == b1)
+        return a0 <= b0 && b0 <= a1;
+    return a0 < b1 && a1 > b0;
+}
+
+CoverageTileSource::CoverageTileSource(const double bbox[4], int minzoom, int maxzoom,
+                                       const string &geojson)
+    : minx(lon2x(bbox[0])), miny(lat2y(bbox[3])),
+      maxx(lon2x(bbox[2])), maxy(lat2y(bbox[1])),
+      minzoom(minzoom), maxzoom(maxzoom)
+{
+    auto edges = std::make_shared<vector<segment>>();
+    if (!geojson.empty()) {
+        pt::ptree tree;
+        try {
+            pt::read_json(geojson, tree);
+            add_geometry(tree, *edges);
+        } catch (const pt::ptree_error& e) {
+            throw std::runtime_error("Error reading " + geojson + ": " + e.what());
+        }
+        if (edges->empty())
+            throw std::runtime_error(geojson + " contains no polygons");
+        polygons = true;
+    }
+
+    // The top-left corner of the world is tested against every edge; from
+    // there on, each node works out its corners from its parent's.
+    node world { 0, 0, 0, false, false, edges };
+    if (polygons)
+        world.corner = crossings_h(*edges, 0, 2, 0);
+    node root { 0, 0, 0, false, world.corner, nullptr };
+    if (classify(root, world))
+        stack.push_back(root);
+
+    count = count_tiles();
+}
+
+// Fills in n.inside and n.edges from its parent. Returns false if the
+// tile lies outside the coverage, which prunes its whole subtree.
+bool CoverageTileSource::classify(node &n, const node &parent) const
+{
+    if (parent.inside) {
+        n.inside = true;
+        return true;
+    }
+
+    double size = 1.0 / double(1L << n.z);
+    double x0 = n.x * size, x1 = x0 + size;
+    double y0 = n.y * size, y1 = y0 + size;
+
+    if (!overlaps(x0, x1, minx, maxx) || !overlaps(y0, y1, miny, maxy))
+        return false;
+    bool in_bbox = minx <= x0 && x1 <= maxx && miny <= y0 && y1 <= maxy;
+
+    if (!polygons) {
+        n.inside = in_bbox;
+        return true;
+    }
+
+    auto edges = std::make_shared<vector<segment>>();
+    for (const segment& s: *parent.edges) {
+        if (intersects(s, x0, y0, x1, y1))
+            edges->push_back(s);
+    }
+
+    if (edges->empty()) {
+        // no edge touches the tile: it's entirely in or entirely out,
+        // just like its corner
+        if (!n.corner)
+            return false;
+        n.inside = in_bbox;
+        n.edges = nullptr;
+        if (!in_bbox)
+            n.edges = edges;
+        return true;
+    }
+    n.inside = false;
+    n.edges = edges;
+    return true;
+}
+
+void CoverageTileSource::expand(const node &n, vector<node> &children) const
+{
+    children.clear();
+    double size = 1.0 / double(1L << n.z);
+    double px = n.x * size, py = n.y * size;
+    for (int j=0; j<2; j++) {
+        for (int i=0; i<2; i++) {
+            node c { n.z + 1, 2 * n.x + i, 2 * n.y + j, false, true, nullptr };
+            if (polygons && !n.inside) {
+                double cx = px + i * size / 2;
+                double cy = py + j * size / 2;
+                c.corner = n.corner != (crossings_h(*n.edges, px, cx, py) !=
+                                        crossings_v(*n.edges, cx, py, cy));
+            }
+            if (classify(c, n))
+                children.push_back(c);
+        }
+    }
+}
+
+// Adds without wrapping: a deep enough zoom range covers more tiles than
+// a long can count, and the total only feeds the progress estimate.
+static long add_saturated(long a, long b)
+{
+    return a > LONG_MAX - b ? LONG_MAX : a + b;
+}
+
+long CoverageTileSource::count_tiles()
+{
+    long total = 0;
+    vector<node> pending = stack;
+    vector<node> children;
+    while (!pending.empty()) {
+        node n = pending.back();
+        pending.pop_back();
+        if (n.inside) {
+            // every descendant in the zoom range is covered
+            long level = 1;
+            for (int z = n.z; z <= maxzoom; z++) {
+                if (z >= minzoom)
+                    total = add_saturated(total, level);
+                level = level > LONG_MAX / 4 ? LONG_MAX : level * 4;
+            }
+            continue;
+        }
+        if (n.z >= minzoom)
+            total = add_saturated(total, 1);
+        if (n.z < maxzoom) {
+            expand(n, children);
+            pending.insert(pending.end(), children.begin(), children.end());
+        }
+    }
+    return total;
+}
+
+bool CoverageTileSource::read(vector<tile> &out, size_t max)
+{
+    size_t n = 0;
+    vector<node> children;
+    while (n < max && !stack.empty()) {
+        node nd = stack.back();
+        stack.pop_back();
+        if (nd.z >= minzoom) {
+            out.push_back({ nd.x, nd.y, nd.z });
+            n++;
+        }
+        if (nd.z < maxzoom) {
+            expand(nd, children);
+            // reversed, so the first child is visited first
+            stack.insert(stack.end(), children.rbegin(), children.rend());
+        }
+    }
+    return n > 0;
+}
@@ -0,0 +1,70 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tilesource.h"
+
+/* Enumerates the tiles of a zoom range that intersect a lon/lat bounding
+ * box and, optionally, the polygons of a GeoJSON file. Tiles are produced
+ * lazily by walking the quadtree depth first, so nothing is materialized
+ * and whole subtrees outside the coverage are skipped without visiting
+ * their tiles; subtrees fully inside it are counted in closed form.
+ *
+ * Everything is computed in Web Mercator tile space, so polygon edges are
+ * taken as straight lines there.
+ */
+class CoverageTileSource : public TileSource {
+    public:
+        struct point { double x, y; };
+        struct segment { point a, b; };
+
+        // bbox is minlon, minlat, maxlon, maxlat. An empty geojson file
+        // name means the whole bounding box is covered.
+        CoverageTileSource(const double bbox[4], int minzoom, int maxzoom,
+                           const std::string& geojson = "");
+        bool read(std::vector<tile>& out, size_t max) override;
+        long total() override { return count; }
+
+    private:
+        typedef std::shared_ptr<const std::vector<segment>> edges_ptr;
+        // A quadtree node waiting to be visited. corner tells whether the
+        // top-left corner of the tile is inside the polygons; edges are the
+        // polygon edges that touch the tile.
+        struct node {
+            int z, x, y;
+            bool inside;
+            bool corner;
+            edges_ptr edges;
+        };
+
+        bool classify(node& n, const node& parent) const;
+        void expand(const node& n, std::vector<node>& children) const;
+        long count_tiles();
+
+        double minx, miny, maxx, maxy;
+        int minzoom, maxzoom;
+        bool polygons = false;
+        std::vector<node> stack;
+        long count = 0;
+};
+
+#endif // COVERAGE_H
@@ -0,0 +1,62 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DIGESTMAP_H
+#define DIGESTMAP_H
+
+#include <mutex>
+#include <unordered_map>
+
+// A map shared by all render threads. It's split in stripes, each with
+// its own lock, so threads looking up different keys rarely wait for
+// each other.
+template<typename K, typename V>
+class DigestMap {
+    public:
+        bool find(const K& key, V& value)
+        {
+            stripe& s = stripe_for(key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = s.map.find(key);
+            if (it == s.map.end())
+                return false;
+            value = it->second;
+            return true;
+        }
+
+        void insert(const K& key, const V& value)
+        {
+            stripe& s = stripe_for(key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.map[key] = value;
+        }
+
+    private:
+        static const int stripes = 64;
+        struct stripe {
+            std::mutex mutex;
+            std::unordered_map<K,V> map;
+        };
+
+        stripe& stripe_for(const K& key)
+        {
+            return _stripes[std::hash<K>()(key) % stripes];
+        }
+
+        stripe _stripes[stripes];
+};
+
+#endif // DIGESTMAP_H
@@ -0,0 +1,88 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "dircache.h"
+
+using std::string;
+using std::mutex;
+using std::lock_guard;
+
+DirHandle::~DirHandle()
+{
+    ::close(fd);
+}
+
+DirCache::DirCache(const string &root, size_t capacity)
+    : root(root), capacity(capacity)
+{
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Error opening " + root + ": " + strerror(errno));
+    root_dir = std::make_shared<DirHandle>(fd);
+}
+
+dir_ptr DirCache::get(const string &path)
+{
+    if (path.empty())
+        return root_dir;
+
+    {
+        lock_guard<mutex> lock(dirs_mutex);
+        auto it = dirs.find(path);
+        if (it != dirs.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Missing directories are rare (once per z/x, or per hash prefix),
+    // so they're opened without holding the lock; the parent comes from
+    // the cache too.
+    size_t slash = path.rfind('/');
+    dir_ptr parent = get(slash == string::npos ? string() : path.substr(0, slash));
+    if (!parent)
+        return nullptr;
+    const char *name = path.c_str() + (slash == string::npos ? 0 : slash + 1);
+    if (mkdirat(parent->fd, name, 0755) < 0 && errno != EEXIST)
+        return nullptr;
+    int fd = openat(parent->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    dir_ptr dir = std::make_shared<DirHandle>(fd);
+
+    lock_guard<mutex> lock(dirs_mutex);
+    auto it = dirs.find(path);
+    if (it != dirs.end()) {
+        // another thread opened it meanwhile; ours is closed on return
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+    lru.emplace_front(path, dir);
+    dirs[path] = lru.begin();
+    while (lru.size() > capacity) {
+        dirs.erase(lru.back().first);
+        lru.pop_back();
+    }
+    return dir;
+}
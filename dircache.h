@@ -0,0 +1,64 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// An open directory, closed when the last user lets go of it
+class DirHandle {
+    public:
+        explicit DirHandle(int fd) : fd(fd) {}
+        ~DirHandle();
+        DirHandle(const DirHandle&) = delete;
+        DirHandle& operator=(const DirHandle&) = delete;
+        const int fd;
+};
+
+typedef std::shared_ptr<DirHandle> dir_ptr;
+
+/* Open directories under a root, by their path relative to it, so files
+ * can be created with openat() and symlinkat() instead of walking the
+ * whole path (and creating its parents) for every tile. Directories are
+ * created the first time they're asked for. The least recently used ones
+ * are closed when there are more than capacity open; a handle still in
+ * use stays open until it's released.
+ */
+class DirCache {
+    public:
+        DirCache(const std::string& root, size_t capacity = 256);
+        // Opens root/path, creating it and its parents if needed. Returns
+        // nullptr (and errno) if that fails.
+        dir_ptr get(const std::string& path);
+
+    private:
+        typedef std::list<std::pair<std::string,dir_ptr>> lru_list;
+
+        std::string root;
+        size_t capacity;
+        dir_ptr root_dir;
+        std::mutex dirs_mutex;
+        // most recently used first
+        lru_list lru;
+        std::unordered_map<std::string,lru_list::iterator> dirs;
+};
+
+#endif // DIRCACHE_H
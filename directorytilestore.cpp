@@ -15,13 +15,20 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 
 #include <iostream>
 #include <sstream>
+#include <cstring>
+#include <climits>
+#include <thread>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
 #include "directorytilestore.h"
+#include "pngoptimizer.h"
 
 namespace fs = boost::filesystem;
 namespace sys = boost::system;
@@ -31,88 +38,281 @@ using std::cout;
 using std::cerr;
 using std::endl;
 
-DirectoryTileStore::DirectoryTileStore(const string &output_dir, int subdirs, bool verbose)
+DirectoryTileStore::DirectoryTileStore(const string &output_dir, int subdirs, bool verbose,
+                                       size_t write_buffer, int writers)
     : output_dir(output_dir), subdirs(subdirs), verbose(verbose)
 {
     boost::system::error_code ec;
     fs::create_directories(output_dir + "/links", ec);
     fs::create_directories(output_dir + "/images", ec);
+    load_rendered_tiles();
+    dirs.reset(new DirCache(output_dir));
+    writer.reset(new FileWriter(write_buffer, writers));
+    if (verbose)
+        cout << "Writing files with " << writer->backend() << endl;
+}
+
+DirectoryTileStore::~DirectoryTileStore()
+{
+    close();
+}
+
+void DirectoryTileStore::close()
+{
+    // images still being optimized are queued before the writer drains
+    if (_optimizer)
+        _optimizer->drain();
+    writer->drain();
+}
+
+bool DirectoryTileStore::finished()
+{
+    return TileStore::finished() && writer->idle();
+}
+
+bool DirectoryTileStore::write_queue(long &entries, size_t &bytes, double &stalled) const
+{
+    entries = writer->size();
+    bytes = writer->bytes();
+    stalled = writer->stall_time();
+    return true;
 }
 
 bool DirectoryTileStore::alreadyRendered(const tile &t)
 {
-    if (verbose)
-        cout << "DirectoryTileStore::alreadyRendered " << t << endl;
-    std::ostringstream o;
-    o << output_dir << "/links/" << t.z << "/" << t.x << "/" << t.y << ".png";
-    fs::path p(o.str());
-    if (verbose)
-        cout << "  path: " << p << endl;
-    if (fs::is_symlink(p))
-    {
-        if (verbose) cout <<   "returning true" << endl;
-        return true;
+    return rendered_tiles.contains(t);
+}
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Calls f(name, type) for every entry in the directory fd, reading as many
+// entries per system call as fit in buf. type may be DT_UNKNOWN on file
+// systems that don't report it. buf holds the entries while f runs, so f
+// must not reuse it.
+template<typename F>
+static bool read_dir(int fd, std::vector<char> &buf, F f)
+{
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return true;
+        for (long pos = 0; pos < n; ) {
+            auto *d = reinterpret_cast<linux_dirent64 *>(buf.data() + pos);
+            if (d->d_reclen == 0 || pos + d->d_reclen > n)
+                return false;
+            pos += d->d_reclen;
+            if (d->d_name[0] != '.')
+                f(d->d_name, d->d_type);
+        }
     }
-    if (verbose) cout <<   "returning false" << endl;
-    return false;
 }
 
-void DirectoryTileStore::storeTile(const tile &t, std::__cxx11::string &&data)
+// Parses the number at the start of name, which must be followed by suffix
+static bool parse_name(const char *name, const char *suffix, int &n)
 {
-    std::ostringstream o;
-    o << output_dir << "/links/" << t.z << "/" << t.x << "/" << t.y << ".png";
-    fs::path tilename(o.str());
+    char *end;
+    errno = 0;
+    long v = strtol(name, &end, 10);
+    if (end == name || errno || v < 0 || v > INT32_MAX || strcmp(end, suffix) != 0)
+        return false;
+    n = v;
+    return true;
+}
+
+// Reads links/z/x/y.png into rendered_tiles, so resuming doesn't stat every
+// tile. The z/x directories are spread over as many threads as there are
+// cores; each thread reads a whole directory with few getdents64 calls
+// and adds its tiles under the lock of their zoom level.
+void DirectoryTileStore::load_rendered_tiles()
+{
+    if (verbose) cout << "Loading rendered tiles from " << output_dir << "/links... ";
+
+    string links = output_dir + "/links";
+    int links_fd = open(links.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (links_fd < 0) {
+        perror((string("Error opening ") + links).c_str());
+        return;
+    }
+
+    // the zoom levels are listed first and their columns afterwards, as
+    // listing a directory overwrites the entries in buf
+    std::vector<int> zooms;
+    std::vector<char> buf(1 << 20);
+    read_dir(links_fd, buf, [&](const char *name, unsigned char) {
+        int z;
+        if (parse_name(name, "", z) && z <= 31)
+            zooms.push_back(z);
+    });
+
+    struct column { int z; int x; int zfd; };
+    std::vector<column> columns;
+    std::vector<int> zoom_fds;
+    for (int z: zooms) {
+        string name = std::to_string(z);
+        int zfd = openat(links_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (zfd < 0)
+            continue;
+        zoom_fds.push_back(zfd);
+        read_dir(zfd, buf, [&](const char *name, unsigned char) {
+            int x;
+            if (parse_name(name, "", x))
+                columns.push_back(column { z, x, zfd });
+        });
+    }
+
+    std::mutex zoom_mutex[32];
+    std::atomic_size_t next { 0 };
+    auto load_columns = [&]() {
+        std::vector<char> buf(1 << 20);
+        std::vector<tile> tiles;
+        size_t i;
+        while ((i = next++) < columns.size()) {
+            const column& c = columns[i];
+            string name = std::to_string(c.x);
+            int fd = openat(c.zfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            tiles.clear();
+            read_dir(fd, buf, [&](const char *name, unsigned char type) {
+                int y;
+                if ((type == DT_LNK || type == DT_UNKNOWN) && parse_name(name, ".png", y))
+                    tiles.push_back(tile { c.x, y, c.z });
+            });
+            ::close(fd);
+            std::lock_guard<std::mutex> lock(zoom_mutex[c.z]);
+            for (const tile& t: tiles)
+                rendered_tiles.insert(t);
+        }
+    };
+
+    int thread_count = std::max(1u, std::min(32u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (int i=0; i<thread_count; i++)
+        threads.emplace_back(load_columns);
+    for (auto& t: threads)
+        t.join();
 
-    sys::error_code ec;
-    fs::create_directories(tilename.parent_path(), ec);
+    for (int fd: zoom_fds)
+        ::close(fd);
+    ::close(links_fd);
 
+    if (verbose) cout << "done (" << rendered_tiles.size() << " tiles)." << endl;
+}
 
-    auto hd = md5(data);
+string DirectoryTileStore::image_path(const string &hash)
+{
     string imgpath = "";
     for (int i=0; i<subdirs; i++) {
-        imgpath += hd.substr(i*2, 2) + "/";
+        imgpath += hash.substr(i*2, 2) + "/";
     }
-    imgpath += hd + ".png";
-    auto image = fs::path(output_dir) / "images" / imgpath;
-    // / (hexdigest(hash) + ".png");
-    //cout << "image: " << image << endl;
-    if (subdirs > 0)
-        fs::create_directories(image.parent_path());
-
-    int ofd = open(image.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
-    if (ofd > 0)
+    imgpath += hash + ".png";
+    return imgpath;
+}
+
+string DirectoryTileStore::image_dir(const string &hash)
+{
+    string dir = "images";
+    for (int i=0; i<subdirs; i++) {
+        dir += "/" + hash.substr(i*2, 2);
+    }
+    return dir;
+}
+
+void DirectoryTileStore::storeTile(const tile &t, std::string &&data, const rawhash &raw)
+{
+    md5digest digest = md5_digest(data);
+    string hd = hexdigest(digest);
+    string imgpath = image_path(hd);
+    string imgdir = image_dir(hd);
+    string imgname = hd + ".png";
+    dir_ptr dir = dirs->get(imgdir);
+    if (!dir) {
+        perror((string("Error creating ") + output_dir + "/" + imgdir).c_str());
+        return;
+    }
+
+    string image = output_dir + "/" + imgdir + "/" + imgname;
+    bool exists;
     {
-        _unique_tiles++;
-        if (verbose)
-            cout << "writing image: " << image << " (" << data.size() << " bytes)" << endl;
-        size_t b = data.size();
-        size_t pos = 0;
-        while (b > 0) {
-            ssize_t r = write(ofd, data.c_str() + pos, std::min<size_t>(8192, data.size() - pos));
-            if (r < 0) {
-                perror((string("Error writing to ") + image.string()).c_str());
-                break;
-            }
-            pos += r;
-            b -= r;
-            if (r == 0) {
-                assert(pos == data.size());
-                assert(b == 0);
-                break;
-            }
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        auto p = pending.find(hd);
+        if (p != pending.end()) {
+            // The image is still being postprocessed or written, this
+            // tile will be linked right after it's in place.
+            p->second.push_back(t);
+            return;
         }
-        ::close(ofd);
-    } else if (errno != EEXIST) {
-        perror((string("Error opening ") + image.string() + "for writing").c_str());
-    } else if (errno == EEXIST) {
+        // Images only get their final name once they're complete, so an
+        // existing one can be linked to right away
+        exists = faccessat(dir->fd, imgname.c_str(), F_OK, 0) == 0;
+        if (!exists) {
+            pending[hd].push_back(t);
+            _unique_tiles++;
+        }
+    }
+
+    if (exists) {
         if (verbose)
             cout << "already existed: " << image << endl;
+        remember(raw, digest);
+        link(t, imgpath);
+        return;
+    }
+
+    // The image file is created by the writer once the image is final,
+    // and the tiles waiting for it are only linked once it's written
+    auto written = [this, imgpath, hd, digest, raw](bool ok) {
+        std::vector<tile> waiting;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            waiting.swap(pending[hd]);
+            pending.erase(hd);
+            if (!ok) {
+                // forget it, so the next tile with this image tries again
+                _unique_tiles--;
+                return;
+            }
+        }
+        remember(raw, digest);
+        for (const tile& w: waiting)
+            link(w, imgpath);
+    };
+    process(std::move(data), hd, [this, dir, image, imgname, written](string&& d) {
+        if (d.empty())
+            written(false);
+        else
+            writer->write(dir, imgname, std::move(d), image, written);
+    });
+}
+
+bool DirectoryTileStore::storeExisting(const tile &t, const stored_image &image)
+{
+    link(t, image_path(hexdigest(image.digest)));
+    return true;
+}
+
+// Links are created relative to their z/x directory, which stays open in
+// the cache while tiles next to each other are being stored.
+void DirectoryTileStore::link(const tile &t, const string &imgpath)
+{
+    string dirname = "links/" + std::to_string(t.z) + "/" + std::to_string(t.x);
+    dir_ptr dir = dirs->get(dirname);
+    if (!dir) {
+        perror((string("Error creating ") + output_dir + "/" + dirname).c_str());
+        return;
     }
 
+    string name = std::to_string(t.y) + ".png";
     string target = string("../../../images/") + imgpath;
     if (verbose)
-        cout << "creating link: " << tilename << " -> " << target << endl;
-    fs::create_symlink(target, tilename, ec);
-    if (ec && (ec.default_error_condition() != sys::errc::file_exists))
-        cerr << "creating link failed with: " << ec.message() << endl;
+        cout << "creating link: " << dirname << "/" << name << " -> " << target << endl;
+    writer->symlink(target, dir, name);
 }
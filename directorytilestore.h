@@ -18,21 +18,47 @@
 #define DIRECTORYTILESTORE_H
 
 #include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
 
 #include "tilestore.h"
+#include "dircache.h"
+#include "filewriter.h"
+#include "tileindex.h"
 
 class DirectoryTileStore : public TileStore {
     public:
-        DirectoryTileStore(const std::string& output_dir, int subdirs = 0, bool verbose = false);
+        DirectoryTileStore(const std::string& output_dir, int subdirs = 0, bool verbose = false,
+                           size_t write_buffer = 64 << 20, int writers = 4);
+        ~DirectoryTileStore();
         bool alreadyRendered(const tile &t) override;
-        void storeTile(const tile &t, std::string&& data) override;
+        void storeTile(const tile &t, std::string&& data, const rawhash& raw) override;
         int unique_tiles() override { return _unique_tiles; }
+        void close() override;
+        bool finished() override;
+        bool write_queue(long& entries, size_t& bytes, double& stalled) const override;
+
+    protected:
+        bool storeExisting(const tile& t, const stored_image& image) override;
 
     private:
+        void load_rendered_tiles();
+        std::string image_path(const std::string& hash);
+        std::string image_dir(const std::string& hash);
+        void link(const tile& t, const std::string& imgpath);
+
         std::atomic_int _unique_tiles {0};
         std::string output_dir;
         int subdirs;
         bool verbose;
+        std::unique_ptr<DirCache> dirs;
+        std::unique_ptr<FileWriter> writer;
+        TileIndex rendered_tiles;
+
+        // images being postprocessed, and the tiles waiting for them
+        std::unordered_map<std::string,std::vector<tile>> pending;
+        std::mutex pending_mutex;
 };
 
 #endif // DIRECTORYTILESTORE_H
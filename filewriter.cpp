@@ -0,0 +1,369 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+#include "filewriter.h"
+
+using std::string;
+using std::cerr;
+using std::endl;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+FileWriter::FileWriter(size_t budget, int threads)
+    : budget(budget)
+{
+#ifdef HAVE_LIBURING
+    // io_uring may be missing or disabled (e.g. by seccomp), in which
+    // case the thread pool takes over
+    uring = io_uring_queue_init(ring_entries, &ring, 0) == 0;
+    if (uring) {
+        this->threads.emplace_back([this]() { uring_loop(); });
+        return;
+    }
+#endif
+    for (int i=0; i<std::max(1, threads); i++)
+        this->threads.emplace_back([this]() { pool_loop(); });
+}
+
+FileWriter::~FileWriter()
+{
+    drain();
+    {
+        lock_guard<mutex> lock(ops_mutex);
+        stopping = true;
+    }
+    work_cond.notify_all();
+    for (auto& t: threads)
+        t.join();
+#ifdef HAVE_LIBURING
+    if (uring)
+        io_uring_queue_exit(&ring);
+#endif
+}
+
+const char *FileWriter::backend() const
+{
+#ifdef HAVE_LIBURING
+    if (uring)
+        return "io_uring";
+#endif
+    return "threads";
+}
+
+// Set on the writer's own threads: operations they queue (from a written
+// callback) must not wait for room, only they can make it.
+static thread_local bool writer_thread = false;
+
+void FileWriter::write(dir_ptr dir, const string &name, string &&data,
+                       const string &path, written_callback done)
+{
+    op *o = new op { op::open_file, -1, std::move(data), 0, name, name + ".tmp", dir, path,
+                     done, false, 0 };
+    queue(o);
+}
+
+void FileWriter::symlink(const string &target, dir_ptr dir, const string &name)
+{
+    op *o = new op { op::make_link, -1, target, 0, name, "", dir, "", nullptr, false, 0 };
+    queue(o);
+}
+
+void FileWriter::queue(op *o)
+{
+    // what the operation keeps in memory until it's done, roughly
+    o->cost = o->data.size() + o->name.size() + o->tmpname.size() + o->path.size() + sizeof(op);
+    unique_lock<mutex> lock(ops_mutex);
+    // an operation bigger than the whole budget still goes through alone
+    auto room = [this, o]() {
+        return writer_thread || in_flight == 0 || in_flight_bytes + o->cost <= budget;
+    };
+    if (!room()) {
+        auto start = std::chrono::steady_clock::now();
+        room_cond.wait(lock, room);
+        stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+    }
+    in_flight++;
+    in_flight_bytes += o->cost;
+    ops.push(o);
+    lock.unlock();
+    work_cond.notify_one();
+}
+
+void FileWriter::done(op **batch, size_t n)
+{
+    {
+        lock_guard<mutex> lock(ops_mutex);
+        for (size_t i=0; i<n; i++) {
+            in_flight--;
+            in_flight_bytes -= batch[i]->cost;
+        }
+    }
+    room_cond.notify_all();
+    idle_cond.notify_all();
+    for (size_t i=0; i<n; i++)
+        delete batch[i];
+}
+
+bool FileWriter::idle()
+{
+    lock_guard<mutex> lock(ops_mutex);
+    return in_flight == 0;
+}
+
+void FileWriter::drain()
+{
+    unique_lock<mutex> lock(ops_mutex);
+    idle_cond.wait(lock, [this]() { return in_flight == 0; });
+}
+
+// Does what's left of an operation with blocking system calls
+void FileWriter::run(op *o)
+{
+    if (o->kind == op::open_file) {
+        o->fd = openat(o->dir->fd, o->tmpname.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+        if (o->fd < 0) {
+            cerr << "Error creating " << o->path << ": " << strerror(errno) << endl;
+            o->failed = true;
+            finish_write(o);
+            return;
+        }
+        o->kind = op::write_file;
+    }
+    if (o->kind == op::write_file) {
+        while (o->written < o->data.size()) {
+            ssize_t r = ::write(o->fd, o->data.data() + o->written, o->data.size() - o->written);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                cerr << "Error writing to " << o->path << ": " << strerror(errno) << endl;
+                o->failed = true;
+                break;
+            }
+            o->written += r;
+        }
+        o->kind = op::close_file;
+    }
+    if (o->kind == op::close_file) {
+        if (::close(o->fd) < 0) {
+            cerr << "Error closing " << o->path << ": " << strerror(errno) << endl;
+            o->failed = true;
+        }
+        o->kind = op::rename_file;
+    }
+    if (o->kind == op::rename_file) {
+        if (!o->failed && renameat(o->dir->fd, o->tmpname.c_str(), o->dir->fd, o->name.c_str()) < 0) {
+            cerr << "Error renaming " << o->path << ": " << strerror(errno) << endl;
+            o->failed = true;
+        }
+        finish_write(o);
+    } else if (o->kind == op::make_link) {
+        if (symlinkat(o->data.c_str(), o->dir->fd, o->name.c_str()) < 0 && errno != EEXIST)
+            cerr << "creating link failed with: " << strerror(errno) << endl;
+    }
+}
+
+// The file is in place (or failed); the caller may now link to it.
+void FileWriter::finish_write(op *o)
+{
+    if (o->failed)
+        unlinkat(o->dir->fd, o->tmpname.c_str(), 0);
+    o->data = string();
+    if (o->written_done)
+        o->written_done(!o->failed);
+}
+
+// Workers take several operations at a time, so the queue's lock is taken
+// once per batch rather than once per file.
+void FileWriter::pool_loop()
+{
+    writer_thread = true;
+    op *batch[64];
+    while (true) {
+        size_t n = 0;
+        {
+            unique_lock<mutex> lock(ops_mutex);
+            work_cond.wait(lock, [this]() { return stopping || !ops.empty(); });
+            if (ops.empty())
+                return;
+            while (!ops.empty() && n < 64) {
+                batch[n++] = ops.front();
+                ops.pop();
+            }
+        }
+        for (size_t i=0; i<n; i++)
+            run(batch[i]);
+        done(batch, n);
+    }
+}
+
+#ifdef HAVE_LIBURING
+
+// Takes everything queued (as much as fits in the ring), submits it with
+// one system call, and handles whatever has completed. Writes cut short
+// and the closes after them go back in the ring from here.
+void FileWriter::uring_loop()
+{
+    writer_thread = true;
+    while (true) {
+        {
+            unique_lock<mutex> lock(ops_mutex);
+            work_cond.wait(lock, [this]() { return stopping || !ops.empty() || ring_ops > 0; });
+            if (stopping && ops.empty() && ring_ops == 0)
+                return;
+            while (!ops.empty() && ring_ops < ring_entries) {
+                prepare(ops.front());
+                ops.pop();
+                ring_ops++;
+            }
+        }
+        io_uring_submit(&ring);
+
+        // Don't sleep for long on completions: new operations may be
+        // queued meanwhile.
+        struct __kernel_timespec timeout = { 0, 1000000 };
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe_timeout(&ring, &cqe, &timeout) != 0)
+            continue;
+        while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+            op *o = static_cast<op *>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            reaped(o, res);
+        }
+    }
+}
+
+void FileWriter::prepare(op *o)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+        // every operation in the ring has at most one entry, and there
+        // are no more operations than entries, but just in case
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    switch (o->kind) {
+    case op::open_file:
+        io_uring_prep_openat(sqe, o->dir->fd, o->tmpname.c_str(),
+                             O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+        break;
+    case op::write_file:
+        io_uring_prep_write(sqe, o->fd, o->data.data() + o->written,
+                            o->data.size() - o->written, o->written);
+        break;
+    case op::close_file:
+        io_uring_prep_close(sqe, o->fd);
+        break;
+    case op::rename_file:
+        io_uring_prep_renameat(sqe, o->dir->fd, o->tmpname.c_str(),
+                               o->dir->fd, o->name.c_str(), 0);
+        break;
+    case op::make_link:
+        io_uring_prep_symlinkat(sqe, o->data.c_str(), o->dir->fd, o->name.c_str());
+        break;
+    }
+    io_uring_sqe_set_data(sqe, o);
+}
+
+void FileWriter::reaped(op *o, int res)
+{
+    // kernels before 5.6 (open) or 5.11 (rename) can't do everything
+    // through io_uring; what's left is done here
+    bool unsupported = res == -EINVAL || res == -EOPNOTSUPP;
+    switch (o->kind) {
+    case op::open_file:
+        if (unsupported) {
+            run(o);
+            break;
+        }
+        if (res < 0) {
+            cerr << "Error creating " << o->path << ": " << strerror(-res) << endl;
+            o->failed = true;
+            finish_write(o);
+            break;
+        }
+        o->fd = res;
+        o->kind = op::write_file;
+        prepare(o);
+        return;
+    case op::write_file:
+        if (res == -EINTR || res == -EAGAIN) {
+            prepare(o);
+            return;
+        }
+        if (res > 0) {
+            o->written += res;
+            if (o->written < o->data.size()) {
+                prepare(o);
+                return;
+            }
+        }
+        if (res < 0 || o->written < o->data.size()) {
+            cerr << "Error writing to " << o->path << ": " << strerror(res < 0 ? -res : EIO) << endl;
+            o->failed = true;
+        }
+        o->kind = op::close_file;
+        prepare(o);
+        return;
+    case op::close_file:
+        if (res < 0) {
+            cerr << "Error closing " << o->path << ": " << strerror(-res) << endl;
+            o->failed = true;
+        }
+        if (o->failed) {
+            finish_write(o);
+            break;
+        }
+        o->kind = op::rename_file;
+        prepare(o);
+        return;
+    case op::rename_file:
+        if (unsupported) {
+            run(o);
+            break;
+        }
+        if (res < 0) {
+            cerr << "Error renaming " << o->path << ": " << strerror(-res) << endl;
+            o->failed = true;
+        }
+        finish_write(o);
+        break;
+    case op::make_link:
+        if (unsupported) {
+            // kernels before 5.15 can't create links through io_uring
+            run(o);
+            break;
+        }
+        if (res < 0 && res != -EEXIST)
+            cerr << "creating link failed with: " << strerror(-res) << endl;
+        break;
+    }
+    ring_ops--;
+    done(&o, 1);
+}
+
+#endif
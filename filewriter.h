@@ -0,0 +1,118 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <queue>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "dircache.h"
+
+/* Writes images and creates links for DirectoryTileStore, so render
+ * threads don't wait for the disk. With io_uring (if atrender was built
+ * with liburing and the kernel allows it) one thread submits everything
+ * that's queued in a single call and reaps the completions; otherwise a
+ * pool of threads does the same work with plain system calls.
+ *
+ * Operations queued and not yet done may hold up to budget bytes; callers
+ * wait for room beyond that. Files are only opened when they're written,
+ * so the number of open files is bounded by the ring or the pool, not by
+ * the budget.
+ */
+class FileWriter {
+    public:
+        FileWriter(size_t budget, int threads);
+        ~FileWriter();
+        typedef std::function<void(bool)> written_callback;
+
+        // Writes data to dir/name.tmp and renames it to dir/name once it's
+        // complete, so name never holds a partial file, even after a
+        // crash. Then calls done, on a writer thread, with whether it
+        // worked; done may queue more operations. path is only used in
+        // error messages.
+        void write(dir_ptr dir, const std::string& name, std::string&& data,
+                   const std::string& path, written_callback done);
+        // Creates a symbolic link dir/name -> target.
+        void symlink(const std::string& target, dir_ptr dir, const std::string& name);
+        // True when everything queued is done.
+        bool idle();
+        // Operations queued and not done yet, and the bytes they hold
+        long size() const { return in_flight.load(std::memory_order_relaxed); }
+        size_t bytes() const { return in_flight_bytes.load(std::memory_order_relaxed); }
+        // Total time callers have waited for room, in seconds
+        double stall_time() const { return stall_ns.load() / 1e9; }
+        // Blocks until idle.
+        void drain();
+        const char *backend() const;
+
+    private:
+        struct op {
+            enum { open_file, write_file, close_file, rename_file, make_link } kind;
+            int fd;
+            std::string data;
+            size_t written;
+            std::string name;
+            std::string tmpname;
+            dir_ptr dir;
+            std::string path;
+            written_callback written_done;
+            bool failed;
+            size_t cost;
+        };
+        void queue(op *o);
+        void done(op **batch, size_t n);
+        void run(op *o);
+        void finish_write(op *o);
+        void pool_loop();
+
+        size_t budget;
+        // only changed with the lock held; atomic so they can be displayed
+        std::atomic<size_t> in_flight_bytes { 0 };
+        std::atomic<int> in_flight { 0 };
+        std::atomic<uint64_t> stall_ns { 0 };
+        bool stopping = false;
+        std::queue<op *> ops;
+        std::vector<std::thread> threads;
+        std::mutex ops_mutex;
+        std::condition_variable work_cond;
+        std::condition_variable room_cond;
+        std::condition_variable idle_cond;
+
+#ifdef HAVE_LIBURING
+        void uring_loop();
+        void prepare(op *o);
+        void reaped(op *o, int res);
+
+        static const unsigned ring_entries = 256;
+        struct io_uring ring;
+        bool uring = false;
+        // operations in the ring, touched by the ring thread only
+        unsigned ring_ops = 0;
+#endif
+};
+
+#endif // FILEWRITER_H
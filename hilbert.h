@@ -0,0 +1,48 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HILBERT_H
+#define HILBERT_H
+
+#include <cstdint>
+
+/* Position of tile (x,y) along the Hilbert curve that fills the
+ * 2^z x 2^z grid of zoom level z. Tiles that are close on the curve
+ * are close on the map, which is what we want for cache locality.
+ */
+inline uint64_t hilbert_index(int z, uint64_t x, uint64_t y)
+{
+    uint64_t n = uint64_t(1) << z;
+    uint64_t d = 0;
+    for (uint64_t s = n / 2; s > 0; s /= 2) {
+        uint64_t rx = (x & s) > 0;
+        uint64_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so the curve stays continuous
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            uint64_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+#endif // HILBERT_H
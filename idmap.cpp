@@ -0,0 +1,146 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+
+#include "idmap.h"
+
+using std::mutex;
+using std::lock_guard;
+
+// MD5 is uniform, so its bits can be used as they are: the low bits of h2
+// pick the stripe and h1 the slot within it.
+IdMap::stripe &IdMap::stripe_for(const md5digest &key)
+{
+    return _stripes[key.h2 % stripes];
+}
+
+// Linear probing: a key is in the first slot from its home slot on that
+// holds it, and isn't in the table if an empty slot comes first.
+IdMap::slot *IdMap::lookup(stripe &s, const md5digest &key)
+{
+    if (s.slots.empty())
+        return nullptr;
+    size_t mask = s.slots.size() - 1;
+    for (size_t i = key.h1 & mask; ; i = (i + 1) & mask) {
+        slot& sl = s.slots[i];
+        if (sl.state == slot_empty)
+            return nullptr;
+        if (sl.key == key)
+            return &sl;
+    }
+}
+
+IdMap::slot &IdMap::add(stripe &s, const md5digest &key)
+{
+    // keep the table at most 70% full, so probe sequences stay short
+    if ((s.count + 1) * 10 > s.slots.size() * 7)
+        grow(s);
+    size_t mask = s.slots.size() - 1;
+    size_t i = key.h1 & mask;
+    while (s.slots[i].state != slot_empty)
+        i = (i + 1) & mask;
+    s.count++;
+    s.slots[i].key = key;
+    return s.slots[i];
+}
+
+void IdMap::grow(stripe &s)
+{
+    std::vector<slot> old(std::max<size_t>(64, s.slots.size() * 2), slot { {0, 0}, 0, slot_empty });
+    old.swap(s.slots);
+    size_t mask = s.slots.size() - 1;
+    for (const slot& sl: old) {
+        if (sl.state == slot_empty)
+            continue;
+        size_t i = sl.key.h1 & mask;
+        while (s.slots[i].state != slot_empty)
+            i = (i + 1) & mask;
+        s.slots[i] = sl;
+    }
+}
+
+bool IdMap::find_or_add(const md5digest &key, std::atomic_int &next_id, entry &e)
+{
+    stripe& s = stripe_for(key);
+    lock_guard<mutex> lock(s.mutex);
+    slot *sl = lookup(s, key);
+    if (sl) {
+        e = entry { sl->id, sl->state == slot_pending };
+        return true;
+    }
+    slot& added = add(s, key);
+    added.id = next_id++;
+    added.state = slot_pending;
+    e = entry { added.id, true };
+    return false;
+}
+
+bool IdMap::find(const md5digest &key, entry &e)
+{
+    stripe& s = stripe_for(key);
+    lock_guard<mutex> lock(s.mutex);
+    slot *sl = lookup(s, key);
+    if (!sl)
+        return false;
+    e = entry { sl->id, sl->state == slot_pending };
+    return true;
+}
+
+void IdMap::insert(const md5digest &key, int id)
+{
+    stripe& s = stripe_for(key);
+    lock_guard<mutex> lock(s.mutex);
+    slot *sl = lookup(s, key);
+    if (!sl)
+        sl = &add(s, key);
+    sl->id = id;
+    sl->state = slot_ready;
+}
+
+void IdMap::set_ready(const md5digest &key)
+{
+    stripe& s = stripe_for(key);
+    lock_guard<mutex> lock(s.mutex);
+    slot *sl = lookup(s, key);
+    if (sl)
+        sl->state = slot_ready;
+}
+
+// Removing a slot would break the probe sequences that pass over it, so
+// the entries after it that belong at or before it are moved back.
+void IdMap::erase(const md5digest &key)
+{
+    stripe& s = stripe_for(key);
+    lock_guard<mutex> lock(s.mutex);
+    slot *sl = lookup(s, key);
+    if (!sl)
+        return;
+    size_t mask = s.slots.size() - 1;
+    size_t hole = sl - s.slots.data();
+    s.slots[hole].state = slot_empty;
+    s.count--;
+    for (size_t j = (hole + 1) & mask; s.slots[j].state != slot_empty; j = (j + 1) & mask) {
+        size_t home = s.slots[j].key.h1 & mask;
+        // move it if its home isn't cyclically in (hole, j]
+        bool between = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (between)
+            continue;
+        s.slots[hole] = s.slots[j];
+        s.slots[j].state = slot_empty;
+        hole = j;
+    }
+}
@@ -0,0 +1,86 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <functional>
+
+// The MD5 of an encoded image, as its 16 raw bytes.
+struct md5digest {
+    uint64_t h1;
+    uint64_t h2;
+    bool operator==(const md5digest& o) const { return h1 == o.h1 && h2 == o.h2; }
+};
+
+namespace std {
+template<> struct hash<md5digest> {
+    size_t operator()(const md5digest& d) const { return d.h1; }
+};
+}
+
+/* Image digest -> image id, for every image in an MBTiles or PMTiles
+ * store. There can be tens of millions of them, so entries are kept
+ * inline in open addressing tables (24 bytes each, instead of a node with
+ * a 32 char hex string) split in stripes, each with its own lock, so
+ * render threads adding different images rarely wait for each other.
+ *
+ * An image can be pending: it has an id, but isn't stored yet because
+ * it's being postprocessed.
+ */
+class IdMap {
+    public:
+        struct entry {
+            int id;
+            bool pending;
+        };
+
+        // Looks key up. If it isn't there, it's added as pending with the
+        // next id and false is returned.
+        bool find_or_add(const md5digest& key, std::atomic_int& next_id, entry& e);
+        bool find(const md5digest& key, entry& e);
+        void insert(const md5digest& key, int id);
+        void set_ready(const md5digest& key);
+        void erase(const md5digest& key);
+
+    private:
+        enum : uint32_t { slot_empty = 0, slot_ready, slot_pending };
+        struct slot {
+            md5digest key;
+            int32_t id;
+            uint32_t state;
+        };
+        struct stripe {
+            std::mutex mutex;
+            std::vector<slot> slots;
+            size_t count = 0;
+        };
+        static const int stripes = 64;
+
+        stripe& stripe_for(const md5digest& key);
+        static slot* lookup(stripe& s, const md5digest& key);
+        static slot& add(stripe& s, const md5digest& key);
+        static void grow(stripe& s);
+
+        stripe _stripes[stripes];
+};
+
+#endif // IDMAP_H
@@ -0,0 +1,167 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstring>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "imageutil.h"
+
+namespace {
+
+inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3_x64_128, fed in pieces: a tile is a view into the metatile
+// buffer, so its rows aren't contiguous.
+class Murmur3 {
+    public:
+        void update(const unsigned char *data, size_t size)
+        {
+            length += size;
+            if (buffered > 0) {
+                size_t n = std::min(size, 16 - buffered);
+                memcpy(buffer + buffered, data, n);
+                buffered += n;
+                data += n;
+                size -= n;
+                if (buffered < 16)
+                    return;
+                block(buffer);
+                buffered = 0;
+            }
+            for (; size >= 16; data += 16, size -= 16)
+                block(data);
+            memcpy(buffer, data, size);
+            buffered = size;
+        }
+
+        rawhash finish()
+        {
+            uint64_t k1 = 0, k2 = 0;
+            const unsigned char *tail = buffer;
+            switch (buffered) {
+                case 15: k2 ^= uint64_t(tail[14]) << 48;
+                case 14: k2 ^= uint64_t(tail[13]) << 40;
+                case 13: k2 ^= uint64_t(tail[12]) << 32;
+                case 12: k2 ^= uint64_t(tail[11]) << 24;
+                case 11: k2 ^= uint64_t(tail[10]) << 16;
+                case 10: k2 ^= uint64_t(tail[ 9]) << 8;
+                case  9: k2 ^= uint64_t(tail[ 8]);
+                    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+                case  8: k1 ^= uint64_t(tail[ 7]) << 56;
+                case  7: k1 ^= uint64_t(tail[ 6]) << 48;
+                case  6: k1 ^= uint64_t(tail[ 5]) << 40;
+                case  5: k1 ^= uint64_t(tail[ 4]) << 32;
+                case  4: k1 ^= uint64_t(tail[ 3]) << 24;
+                case  3: k1 ^= uint64_t(tail[ 2]) << 16;
+                case  2: k1 ^= uint64_t(tail[ 1]) << 8;
+                case  1: k1 ^= uint64_t(tail[ 0]);
+                    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+            }
+
+            h1 ^= length;
+            h2 ^= length;
+            h1 += h2;
+            h2 += h1;
+            h1 = fmix64(h1);
+            h2 = fmix64(h2);
+            h1 += h2;
+            h2 += h1;
+            return rawhash { h1, h2 };
+        }
+
+    private:
+        void block(const unsigned char *p)
+        {
+            uint64_t k1, k2;
+            memcpy(&k1, p, 8);
+            memcpy(&k2, p + 8, 8);
+
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+            h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+        }
+
+        static const uint64_t c1 = 0x87c37b91114253d5ULL;
+        static const uint64_t c2 = 0x4cf5ad432745937fULL;
+        uint64_t h1 = 0;
+        uint64_t h2 = 0;
+        uint64_t length = 0;
+        unsigned char buffer[16];
+        size_t buffered = 0;
+};
+
+}
+
+rawhash hash_image(const mapnik::image_view<mapnik::image_rgba8>& view)
+{
+    Murmur3 h;
+    size_t row_size = view.width() * sizeof(mapnik::image_rgba8::pixel_type);
+    for (size_t y = 0; y < view.height(); y++)
+        h.update(reinterpret_cast<const unsigned char *>(view.get_row(y)), row_size);
+    return h.finish();
+}
+
+bool is_solid(const mapnik::image_view<mapnik::image_rgba8>& view, uint32_t& color)
+{
+    typedef mapnik::image_rgba8::pixel_type pixel;
+    size_t width = view.width();
+    if (width == 0 || view.height() == 0)
+        return false;
+    color = view.get_row(0)[0];
+
+#ifdef __SSE2__
+    __m128i c = _mm_set1_epi32(color);
+#endif
+    for (size_t y = 0; y < view.height(); y++) {
+        const pixel *row = view.get_row(y);
+        size_t x = 0;
+#ifdef __SSE2__
+        for (; x + 16 <= width; x += 16) {
+            const __m128i *p = reinterpret_cast<const __m128i *>(row + x);
+            __m128i a = _mm_and_si128(
+                        _mm_cmpeq_epi32(_mm_loadu_si128(p), c),
+                        _mm_cmpeq_epi32(_mm_loadu_si128(p + 1), c));
+            __m128i b = _mm_and_si128(
+                        _mm_cmpeq_epi32(_mm_loadu_si128(p + 2), c),
+                        _mm_cmpeq_epi32(_mm_loadu_si128(p + 3), c));
+            if (_mm_movemask_epi8(_mm_and_si128(a, b)) != 0xffff)
+                return false;
+        }
+#endif
+        for (; x < width; x++)
+            if (row[x] != color)
+                return false;
+    }
+    return true;
+}
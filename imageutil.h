@@ -0,0 +1,55 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef IMAGEUTIL_H
+#define IMAGEUTIL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include <mapnik/image.hpp>
+#include <mapnik/image_view.hpp>
+
+// A 128 bit hash of the pixels of a rendered tile, before encoding it.
+// This is MurmurHash3 (x64, 128 bit): it isn't cryptographic, but it's
+// several times faster than MD5 and has no known collisions on
+// non-adversarial data.
+struct rawhash {
+    uint64_t h1;
+    uint64_t h2;
+    bool operator==(const rawhash& o) const { return h1 == o.h1 && h2 == o.h2; }
+};
+
+namespace std {
+template<> struct hash<rawhash> {
+    size_t operator()(const rawhash& r) const { return r.h1; }
+};
+}
+
+rawhash hash_image(const mapnik::image_view<mapnik::image_rgba8>& view);
+
+// Returns true, and the color, if every pixel in the view is the same.
+bool is_solid(const mapnik::image_view<mapnik::image_rgba8>& view, uint32_t& color);
+
+// The key solid tiles of a given color are stored under, in place of
+// hash_image's result.
+inline rawhash solid_hash(uint32_t color)
+{
+    return rawhash { color, 0x534f4c4944000000ULL }; // "SOLID"
+}
+
+#endif // IMAGEUTIL_H
@@ -0,0 +1,106 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+
+#include <mapnik/layer.hpp>
+#include <mapnik/query.hpp>
+#include <mapnik/datasource.hpp>
+
+#include "layerprobe.h"
+
+// agg's rounding multiplication of 8 bit values, used to premultiply
+static uint32_t multiply(uint32_t a, uint32_t b)
+{
+    uint32_t t = a * b + 128;
+    return ((t >> 8) + t) >> 8;
+}
+
+// The background color after the round trip agg_renderer puts it through:
+// it fills the image premultiplied and demultiplies it when done, which
+// loses precision for translucent colors.
+static uint32_t rendered_color(uint32_t rgba)
+{
+    uint32_t a = rgba >> 24;
+    if (a == 255)
+        return rgba;
+    if (a == 0)
+        return 0;
+    uint32_t color = a << 24;
+    for (int shift = 0; shift < 24; shift += 8) {
+        uint32_t c = multiply((rgba >> shift) & 0xff, a) * 255 / a;
+        color |= std::min(c, 255u) << shift;
+    }
+    return color;
+}
+
+LayerProbe::LayerProbe(const mapnik::Map &m)
+    : map_prj(m.srs(), true)
+{
+    for (const mapnik::layer& l: m.layers()) {
+        if (!l.active() || !l.datasource())
+            continue;
+        layer p;
+        p.l = &l;
+        p.prj.reset(new mapnik::projection(l.srs(), true));
+        p.tr.reset(new mapnik::proj_transform(map_prj, *p.prj));
+        p.envelope = l.datasource()->envelope();
+        layers.push_back(std::move(p));
+    }
+
+    has_background_image = bool(m.background_image());
+    // rgba() is packed the same way as image_rgba8's pixels
+    background_color = m.background() ? rendered_color(m.background()->rgba()) : 0;
+}
+
+bool LayerProbe::any_features(const mapnik::box2d<double> &bbox, double pixel_size,
+                              int buffer, mode how, double scale_denominator,
+                              const std::unordered_set<std::string> &ignore)
+{
+    for (const layer& p: layers) {
+        if (scale_denominator >= 0 && !p.l->visible(scale_denominator))
+            continue;
+        if (!ignore.empty() && ignore.count(p.l->name()) > 0)
+            continue;
+
+        // padded the way mapnik pads the query for each layer when
+        // rendering (twice the buffer on each side), with the layer's own
+        // buffer when it has one
+        mapnik::box2d<double> b = bbox;
+        boost::optional<int> layer_buffer = p.l->buffer_size();
+        b.pad(2.0 * pixel_size * (layer_buffer ? *layer_buffer : buffer));
+        // if we can't tell, assume there's something there
+        if (!p.tr->forward(b))
+            return true;
+        if (!p.envelope.intersects(b))
+            continue;
+        if (how == envelope)
+            return true;
+
+        mapnik::featureset_ptr fs = p.l->datasource()->features(mapnik::query(b));
+        if (fs && fs->next())
+            return true;
+    }
+    return false;
+}
+
+bool LayerProbe::background(uint32_t &color) const
+{
+    if (has_background_image)
+        return false;
+    color = background_color;
+    return true;
+}
@@ -0,0 +1,73 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAYERPROBE_H
+#define LAYERPROBE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include <mapnik/map.hpp>
+#include <mapnik/box2d.hpp>
+#include <mapnik/projection.hpp>
+#include <mapnik/proj_transform.hpp>
+
+/* Asks the layers of a map whether they have anything in an area, without
+ * rendering it. Projections and envelopes are prepared once per map, so
+ * each render thread should have its own probe.
+ */
+class LayerProbe {
+    public:
+        enum mode {
+            envelope, // only compare with the datasource's envelope
+            query     // also run a bbox query and look for a first feature
+        };
+
+        LayerProbe(const mapnik::Map& m);
+        LayerProbe(const LayerProbe&) = delete;
+        LayerProbe& operator=(const LayerProbe&) = delete;
+
+        // Whether any active layer (but those in ignore) may have features
+        // in bbox, given in the map's srs, or in the buffer mapnik would
+        // query around it: the layer's buffer-size, or buffer if it doesn't
+        // set one, in pixels of pixel_size map units. Layers not visible at scale_denominator
+        // are skipped, unless it's negative.
+        bool any_features(const mapnik::box2d<double>& bbox, double pixel_size, int buffer,
+                          mode how, double scale_denominator = -1,
+                          const std::unordered_set<std::string>& ignore = {});
+
+        // The color of a tile with nothing on it, if the map has no
+        // background image, as the renderer leaves it: premultiplied and
+        // demultiplied again.
+        bool background(uint32_t& color) const;
+
+    private:
+        struct layer {
+            const mapnik::layer *l;
+            std::unique_ptr<mapnik::projection> prj;
+            std::unique_ptr<mapnik::proj_transform> tr;
+            mapnik::box2d<double> envelope;
+        };
+
+        mapnik::projection map_prj;
+        std::vector<layer> layers;
+        bool has_background_image;
+        uint32_t background_color;
+};
+
+#endif // LAYERPROBE_H
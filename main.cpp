@@ -16,9 +16,9 @@
 
 #include <stdio.h>
 
-#include <fstream>
 #include <memory>
 #include <mutex>
+#include <unordered_set>
 #include <thread>
 #include <vector>
 #include <string>
@@ -40,19 +40,32 @@
 #include <mapnik/agg_renderer.hpp>
 #include <mapnik/image_view_any.hpp>
 #include <mapnik/datasource_cache.hpp>
+#include <mapnik/layer.hpp>
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <errno.h>
 
 #define ATRENDER_VERSION "0.1"
 
 #include "tilestore.h"
+#include "tilesource.h"
+#include "coverage.h"
+#include "scheduler.h"
 #include "directorytilestore.h"
 #include "mbtiles.h"
+#include "pmtiles.h"
+#include "archivetilestore.h"
+#include "pngoptimizer.h"
+#include "coprocess.h"
+#include "imageutil.h"
+#include "solidindex.h"
+#include "layerprobe.h"
+#include "renderworker.h"
 
 namespace fs = boost::filesystem;
 //namespace sys = boost::system;
@@ -125,10 +138,13 @@ struct projectionconfig * get_projection(const char * srs) {
 
 mapnik::box2d<double> tile2prjbounds(struct projectionconfig * prj, int x, int y, int z)
 {
-    double p0x = prj->bound_x0 + (prj->bound_x1 - prj->bound_x0)* ((double)x / (double)(prj->aspect_x * 1<<z));
-    double p0y = (prj->bound_y1 - (prj->bound_y1 - prj->bound_y0)* (((double)y + 1) / (double)(prj->aspect_y * 1<<z)));
-    double p1x = prj->bound_x0 + (prj->bound_x1 - prj->bound_x0)* (((double)x + 1) / (double)(prj->aspect_x * 1<<z));
-    double p1y = (prj->bound_y1 - (prj->bound_y1 - prj->bound_y0)* ((double)y / (double)(prj->aspect_y * 1<<z)));
+    // in double: 2^z times the aspect overflows an int at z = 31
+    double tiles_x = prj->aspect_x * double(1L << z);
+    double tiles_y = prj->aspect_y * double(1L << z);
+    double p0x = prj->bound_x0 + (prj->bound_x1 - prj->bound_x0)* ((double)x / tiles_x);
+    double p0y = (prj->bound_y1 - (prj->bound_y1 - prj->bound_y0)* (((double)y + 1) / tiles_y));
+    double p1x = prj->bound_x0 + (prj->bound_x1 - prj->bound_x0)* (((double)x + 1) / tiles_x);
+    double p1y = (prj->bound_y1 - (prj->bound_y1 - prj->bound_y0)* ((double)y / tiles_y));
 
     mapnik::box2d<double> bbox(p0x, p0y, p1x,p1y);
     return  bbox;
@@ -139,86 +155,373 @@ struct Args
     string input;
     string xml;
     int threads;
+    int processes;
     string output_dir;
     string mbtiles;
+    string pmtiles;
+    string archive;
     string postprocess;
+    string coprocess;
+    int postprocessors;
     string tempdir;
+    bool optimize;
+    int optimize_threads;
     bool verbose;
     int subdirs;
+    int metatile;
+    string order;
+    int run_length;
+    int window;
+    string save_quadkeys;
+    string zoom;
+    int minzoom;
+    int maxzoom;
+    string bbox;
+    double bounds[4];
+    string coverage;
+    bool prune_solid;
+    string prune_layers;
+    string skip_empty;
+    bool bulk;
+    bool defer_index;
+    int batch_size;
+    string write_buffer;
+    int writers;
+    int shards;
+    bool merge;
+    string finalize;
+    bool keep_idmap;
 };
 
 Args args;
 
-//std::atomic_int unique_tiles;
-std::atomic_int rendered_tiles;
+// Every render thread keeps its own counters and the progress loop adds
+// them up, so threads never write to a shared cache line. The alignment
+// keeps the counters of different threads on different cache lines too. With
+// --processes they're in shared memory, and each worker and the thread
+// feeding it have a set each.
+struct alignas(64) thread_counters {
+    std::atomic_long processed {0};
+    std::atomic_long rendered {0};
+    std::atomic_long solid {0};
+    std::atomic_long pruned {0};
+    std::atomic_long empty {0};
+    std::atomic_long skipped_renders {0};
+};
+
+// Only the owning thread writes its counters, so a relaxed load and store
+// is enough and avoids a locked read-modify-write on every tile.
+inline void bump(std::atomic_long& counter, long n = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+thread_counters *counters;
+int counters_size = 0;
 
+void allocate_counters(int n)
+{
+    void *p = mmap(nullptr, n * sizeof(thread_counters), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "Error allocating counters");
+    counters = new (p) thread_counters[n];
+    counters_size = n;
+}
 
-void render(Map &m, projectionconfig *prj, TileStore& store, const tile& t)
+long total(std::atomic_long thread_counters::* counter)
 {
-    if (store.alreadyRendered(t))
+    long r = 0;
+    for (int i=0; i<counters_size; i++)
+        r += (counters[i].*counter).load(std::memory_order_relaxed);
+    return r;
+}
+
+long total_processed() { return total(&thread_counters::processed); }
+long total_rendered() { return total(&thread_counters::rendered); }
+long total_solid() { return total(&thread_counters::solid); }
+long total_pruned() { return total(&thread_counters::pruned); }
+long total_empty() { return total(&thread_counters::empty); }
+long total_skipped_renders() { return total(&thread_counters::skipped_renders); }
+
+
+mapnik::box2d<double> metatile2prjbounds(struct projectionconfig * prj, const metatile& mt)
+{
+    mapnik::box2d<double> tl = tile2prjbounds(prj, mt.x, mt.y, mt.z);
+    mapnik::box2d<double> br = tile2prjbounds(prj, mt.x + (mt.size - 1), mt.y + (mt.size - 1), mt.z);
+    return mapnik::box2d<double>(tl.minx(), br.miny(), br.maxx(), tl.maxy());
+}
+
+// Only with --prune-solid
+std::unique_ptr<SolidIndex> solid_tiles;
+std::unordered_set<string> prune_layers;
+
+// Only with --skip-empty
+bool skip_empty = false;
+LayerProbe::mode skip_empty_mode;
+
+// Stores t as a tile of a single color, encoding that color's image only
+// the first time.
+void store_solid(TileStore& store, const tile& t, uint32_t color)
+{
+    rawhash raw = solid_hash(color);
+    if (store.storeDuplicate(t, raw))
         return;
 
-    m.resize(256,256);
-    m.zoom_to_box(tile2prjbounds(prj,t.x,t.y,t.z));
+    mapnik::image_rgba8 img(RENDER_SIZE, RENDER_SIZE);
+    img.set(color);
+    mapnik::image_view<mapnik::image_rgba8> v1(0, 0, RENDER_SIZE, RENDER_SIZE, img);
+    struct mapnik::image_view_any view(v1);
+    store.storeTile(t, mapnik::save_to_string(view, "png256"), raw);
+}
 
+// Stores the tiles under a solid tile of a coarser level as copies of it,
+// and takes them out of pending.
+void prune(TileStore& store, vector<tile>& pending, thread_counters& c)
+{
+    auto out = pending.begin();
+    for (const tile& t: pending) {
+        uint32_t color;
+        if (solid_tiles->find(t, color) && store.storeDuplicate(t, solid_hash(color))) {
+            bump(c.rendered);
+            bump(c.solid);
+            bump(c.pruned);
+            continue;
+        }
+        *out++ = t;
+    }
+    pending.erase(out, pending.end());
+}
+
+// The tiles of mt that still have to be rendered
+vector<tile> pending_tiles(TileStore& store, const metatile& mt, thread_counters& c)
+{
+    vector<tile> pending;
+    for (auto i = mt.begin; i != mt.end; ++i) {
+        if (!store.alreadyRendered(*i))
+            pending.push_back(*i);
+    }
+    if (solid_tiles)
+        prune(store, pending, c);
+    return pending;
+}
+
+// With --prune-solid, records that mt rendered as a single color
+void mark_solid(const metatile& mt, uint32_t color)
+{
+    for (int i = 0; i < mt.size; i++)
+        for (int j = 0; j < mt.size; j++)
+            solid_tiles->insert({ mt.x + i, mt.y + j, mt.z }, color);
+}
+
+// Renders mt and stores its pending tiles. Returns true, and the color, if
+// the whole metatile is solid in a way --prune-solid can trust.
+bool render_tiles(Map &m, LayerProbe& probe, projectionconfig *prj, TileStore& store,
+                  const metatile& mt, const vector<tile>& pending, thread_counters& c,
+                  uint32_t& solid_color)
+{
     if (m.buffer_size() == 0) { // Only set buffer size if the buffer size isn't explicitly set in the mapnik stylesheet.
         m.set_buffer_size(128);
     }
 
-    mapnik::image_rgba8 buf(RENDER_SIZE, RENDER_SIZE);
+    // With --prune-solid the buffer is part of the image, so a solid image
+    // means nothing around the metatile reaches into it either.
+    int margin = solid_tiles ? m.buffer_size() : 0;
+    int size = RENDER_SIZE * mt.size;
+    mapnik::box2d<double> bbox = metatile2prjbounds(prj, mt);
+    bbox.pad(bbox.width() / size * margin);
+    m.resize(size + 2 * margin, size + 2 * margin);
+    m.zoom_to_box(bbox);
+
+    // With --skip-empty, a metatile where no layer has anything (buffer
+    // included) is just the background color
+    uint32_t background;
+    if (skip_empty && probe.background(background) &&
+            !probe.any_features(m.get_current_extent(), m.scale(), m.buffer_size(),
+                                skip_empty_mode, m.scale_denominator())) {
+        for (const tile& t: pending) {
+            store_solid(store, t, background);
+            bump(c.rendered);
+            bump(c.solid);
+            bump(c.empty);
+        }
+        bump(c.skipped_renders);
+        return false;
+    }
+
+    mapnik::image_rgba8 buf(size + 2 * margin, size + 2 * margin);
     mapnik::agg_renderer<mapnik::image_rgba8> ren(m,buf);
     ren.apply(); // <-- Here's where the map is rendered
-    rendered_tiles++;
 
-    mapnik::image_view<mapnik::image_rgba8> v1(0, 0, 256, 256, buf);
-    struct mapnik::image_view_any view(v1);
+    bool solid = false;
+    if (solid_tiles) {
+        mapnik::image_view<mapnik::image_rgba8> all(0, 0, buf.width(), buf.height(), buf);
+        // a solid area can only be trusted to stay solid at deeper levels
+        // if the layers not listed in --prune-layers have nothing in it
+        solid = !prune_layers.empty() && is_solid(all, solid_color) &&
+                !probe.any_features(bbox, m.scale(), 0, LayerProbe::query, -1, prune_layers);
+    }
+
+    for (const tile& t: pending) {
+        mapnik::image_view<mapnik::image_rgba8> v1(
+                    margin + (t.x - mt.x) * RENDER_SIZE, margin + (t.y - mt.y) * RENDER_SIZE,
+                    RENDER_SIZE, RENDER_SIZE, buf);
+        bump(c.rendered);
+
+        // Most tiles (sea, land) are duplicates; hashing the pixels lets
+        // them skip the PNG encoding altogether. Solid tiles don't even
+        // need the hash, their color is enough.
+        uint32_t color;
+        rawhash raw;
+        if (is_solid(v1, color)) {
+            raw = solid_hash(color);
+            bump(c.solid);
+        } else {
+            raw = hash_image(v1);
+        }
+        if (store.storeDuplicate(t, raw))
+            continue;
 
-    //cout << "first rendered byte is at " << (void*)(&(data.at(0))) << endl;
-    string data = mapnik::save_to_string(view, "png256");
+        struct mapnik::image_view_any view(v1);
 
-    store.storeTile(t, std::move(data));
+        //cout << "first rendered byte is at " << (void*)(&(data.at(0))) << endl;
+        string data = mapnik::save_to_string(view, "png256");
+
+        store.storeTile(t, std::move(data), raw);
+    }
+    return solid;
 }
 
-std::atomic_int tilecount;
-std::atomic_int finished_threads;
+void render(Map &m, LayerProbe& probe, projectionconfig *prj, TileStore& store, const metatile& mt, thread_counters& c)
+{
+    vector<tile> pending = pending_tiles(store, mt, c);
+    if (pending.empty())
+        return;
+    uint32_t color;
+    if (render_tiles(m, probe, prj, store, mt, pending, c, color))
+        mark_solid(mt, color);
+}
 
-vector<tile> tiles;
-vector<tile>::iterator next_tile;
-std::mutex next_tile_mutex;
+void report_failure(const metatile& mt, const std::exception& e)
+{
+    tile t { mt.x, mt.y, mt.z };
+    cerr << "rendering metatile " << t << " (size " << mt.size << ") failed with:" << endl;
+    cerr << e.what() << endl;
+}
 
-vector<tile>::iterator get_next_tile() {
-    std::lock_guard<std::mutex> lock(next_tile_mutex);
+// Datasource types that can be queried from several threads at once. A
+// copied map shares these with the original; layers of any other type
+// get a datasource of their own, created from the same parameters.
+const std::unordered_set<string> shared_datasources {
+    "shape", "postgis", "pgraster", "raster", "csv", "geojson", "topojson"
+};
 
-    //cout << "next_tile - tiles.begin(): " << next_tile - tiles.begin() << endl;
-    if (next_tile == tiles.end())
-        return tiles.end();
-    auto r = next_tile;
-    ++next_tile;
-    return r;
+// Gives layers new datasources, except those of a shared type.
+void own_datasources(std::vector<mapnik::layer>& layers)
+{
+    for (mapnik::layer& l: layers) {
+        own_datasources(l.layers());
+        mapnik::datasource_ptr ds = l.datasource();
+        if (!ds)
+            continue;
+        boost::optional<string> type = ds->params().get<string>("type");
+        if (!type || !shared_datasources.count(*type))
+            l.set_datasource(mapnik::datasource_cache::instance().create(ds->params()));
+    }
+}
+
+// A copy of m for another render thread, without parsing the stylesheet
+// again.
+std::unique_ptr<Map> copy_map(const Map& m)
+{
+    std::unique_ptr<Map> copy(new Map(m));
+    own_datasources(copy->layers());
+    return copy;
+}
+
+std::atomic_int finished_threads;
+// render workers that died before rendering all their tiles
+std::atomic_int dead_workers;
+
+std::unique_ptr<Scheduler> scheduler;
+
+void render_thread(const std::shared_ptr<TileStore> store, Map& m, int index) {
+    thread_counters& c = counters[index];
+    LayerProbe probe(m);
+
+    run r;
+    while (scheduler->next(r)) {
+        for (auto i = r.begin; i != r.end; ++i) {
+            const metatile& mt = *i;
+            try {
+                render(m, probe, get_projection(m.srs().c_str()), *store, mt, c);
+            } catch (const std::exception& e) {
+                report_failure(mt, e);
+            }
+            bump(c.processed, mt.end - mt.begin);
+        }
+    }
+    finished_threads++;
 }
 
-void render_thread(const std::shared_ptr<TileStore> store, const string& xml) {
+// With --processes, the main loop of render worker index: loads the map
+// and renders the metatiles it's sent. The map is loaded after forking, as
+// datasources open connections while loading, and some (postgis) put them
+// in a process-wide pool that forked workers would otherwise share.
+void render_worker(const string& xml, int index, WorkerChannel& channel)
+{
+    thread_counters& c = counters[index];
     Map m;
-    mapnik::load_map(m,xml);
+    try {
+        mapnik::load_map(m, xml);
+    } catch (const std::exception& e) {
+        cerr << "Render worker " << index << " couldn't load " << xml << ": " << e.what() << endl;
+        return;
+    }
+    LayerProbe probe(m);
+    projectionconfig *prj = get_projection(m.srs().c_str());
+    WorkerStore store(channel);
 
-    while (true) {
-        auto i = get_next_tile();
-        if (i == tiles.end())
-            break;
-        const tile& t = *i;
-        //cout << "thread " << std::this_thread::get_id() << " ";
-        //cout << "rendering " << outputdir
-        //     << "/" << t.z
-        //     << "/" << t.x
-        //     << "/" << t.y << ".png" << endl;
-        //cout << "store.use_count(): " << store.use_count() << endl;
+    metatile mt;
+    vector<tile> pending;
+    while (channel.next(mt, pending)) {
         try {
-            render(m, get_projection(m.srs().c_str()), *store, t);
-        } catch (std::exception e) {
-            cerr << "rendering tile " << t << "failed with:" << endl;
-            cerr << e.what() << endl;
+            uint32_t color;
+            if (render_tiles(m, probe, prj, store, mt, pending, c, color))
+                channel.solid(color);
+        } catch (const std::exception& e) {
+            report_failure(mt, e);
+        }
+        channel.done();
+    }
+}
+
+// With --processes, takes metatiles from the scheduler, as render_thread
+// does, and has worker index render them. If the worker dies, the rest of
+// the tiles it would have rendered are skipped; they're rendered by the
+// next run over the same store, and this run fails.
+void worker_feed_thread(const std::shared_ptr<TileStore> store, WorkerChannel& channel, int index)
+{
+    thread_counters& c = counters[counters_size / 2 + index];
+    bool alive = true;
+
+    run r;
+    while (scheduler->next(r)) {
+        for (auto i = r.begin; i != r.end; ++i) {
+            const metatile& mt = *i;
+            vector<tile> pending = pending_tiles(*store, mt, c);
+            if (!pending.empty() && alive) {
+                alive = channel.render(mt, pending, *store, [&mt](uint32_t color) {
+                    mark_solid(mt, color);
+                });
+                if (!alive) {
+                    dead_workers++;
+                    cerr << "Skipping the rest of the tiles of render worker " << index
+                         << ", run again to render them" << endl;
+                }
+            }
+            bump(c.processed, mt.end - mt.begin);
         }
-        tilecount++;
     }
     finished_threads++;
 }
@@ -239,16 +542,89 @@ int parse_args(int argc, char *argv[], Args *args) {
                     "mapnik XML stylesheet")
             (",n", po::value<int>(&args->threads)->default_value(1),
                     "number of threads")
+            ("processes", po::value<int>(&args->processes)->default_value(0),
+                    "render in this many forked processes instead of -n threads. "
+                    "Each process loads the map after forking, so it opens its "
+                    "own datasources and database connections, then renders "
+                    "and encodes its tiles and sends them to the main process, "
+                    "which deduplicates and stores them")
             (",p", po::value<string>(&args->postprocess),
                     "postprocess tiles with the given command. The command will "
                     "receive as its only argument the filename, ending in \".png\", "
                     "of the rendered tile. The command should use the same filename "
                     "for its result.")
+            (",P", po::value<string>(&args->coprocess),
+                    "postprocess tiles with long-running copies of the given "
+                    "command. Each copy is started once and handles many tiles: "
+                    "it reads a 4 byte big-endian length followed by that many "
+                    "bytes of PNG on its standard input and writes the result "
+                    "the same way to its standard output; a length of 0 means "
+                    "an error. No temporary files are used. A copy that takes "
+                    "more than a minute over a tile is killed and restarted.")
+            ("postprocessors", po::value<int>(&args->postprocessors)->default_value(0),
+                    "number of copies of the -P command to run (default: one "
+                    "per core)")
             (",t", po::value<string>(&args->tempdir),
                     "directory for temporary files; these will be created only "
                     "if postprocessing is enabled.")
+            ("optimize,O", po::bool_switch(&args->optimize)->default_value(false),
+                    "optimize tiles in-process: reduce them to the smallest "
+                    "palette and bit depth and keep the smallest of several "
+                    "zlib strategies; this does what optimize_png.py does "
+                    "without running any commands")
+            ("optimize-threads", po::value<int>(&args->optimize_threads)->default_value(0),
+                    "number of threads optimizing tiles with -O (default: one "
+                    "per core)")
             (",d", po::value<string>(&args->output_dir),
                     "save tiles to given directory")
+            ("metatile", po::value<int>(&args->metatile)->default_value(1),
+                    "render blocks of NxN tiles as a single image and slice them "
+                    "into 256px tiles; this saves the per-tile overhead of "
+                    "querying datasources and placing labels on the buffered "
+                    "area around every tile. N must be a power of two, so "
+                    "blocks line up with the world's edge")
+            ("order", po::value<string>(&args->order)->default_value("hilbert"),
+                    "order in which tiles are rendered: \"hilbert\" renders runs "
+                    "of neighbouring tiles (runs are picked in random order to keep "
+                    "the ETA stable); \"shuffle\" renders tiles in random order")
+            ("run-length", po::value<int>(&args->run_length)->default_value(64),
+                    "number of neighbouring metatiles in each run when using "
+                    "--order hilbert")
+            ("window", po::value<int>(&args->window)->default_value(1000000),
+                    "number of input tiles read, ordered and scheduled at a "
+                    "time; this bounds memory use with huge tile lists")
+            ("zoom,z", po::value<string>(&args->zoom),
+                    "instead of reading an input file, render every tile of "
+                    "the given zoom levels (e.g. 0-14 or 12) within --bbox and "
+                    "--coverage")
+            ("bbox", po::value<string>(&args->bbox),
+                    "with --zoom, only render tiles that intersect the given "
+                    "bounding box: minlon,minlat,maxlon,maxlat (default: the "
+                    "whole world)")
+            ("coverage", po::value<string>(&args->coverage),
+                    "with --zoom, only render tiles that intersect the polygons "
+                    "in the given GeoJSON file")
+            ("prune-solid", po::bool_switch(&args->prune_solid)->default_value(false),
+                    "render zoom levels coarse to fine and don't render tiles "
+                    "under a tile that rendered as a single color (buffer "
+                    "included); they're stored as copies of it. The buffer is "
+                    "rendered as part of every image, which costs less with "
+                    "--metatile")
+            ("prune-layers", po::value<string>(&args->prune_layers),
+                    "with --prune-solid, comma separated list of layers that "
+                    "look the same at every zoom level (e.g. water, land); a "
+                    "solid tile is only pruned if no other layer has features "
+                    "in it. Required by --prune-solid")
+            ("skip-empty", po::value<string>(&args->skip_empty),
+                    "don't render metatiles where no layer has features; they're "
+                    "stored as the background color. \"envelope\" only compares "
+                    "the (buffered) metatile with each datasource's extent; "
+                    "\"query\" also asks the datasource for features in it. "
+                    "Ignored if the map has a background image")
+            ("save-quadkeys", po::value<string>(&args->save_quadkeys),
+                    "convert the input tiles file to the binary quadkey format "
+                    "and save it to the given file, then exit; binary lists "
+                    "can be used as input files and load faster")
             ("subdirs,s", po::value<int>(&args->subdirs)->default_value(0),
                     "when using an output directory (-d) to store tiles avoid too "
                     "many images per folder by spreading files in subdirectories "
@@ -257,6 +633,48 @@ int parse_args(int argc, char *argv[], Args *args) {
                     "    abcdefgh.png -> ab/cd/abcdefgh.png")
             ("mbtiles,m", po::value<string>(&args->mbtiles),
                     "save tiles as an MBTiles file")
+            ("pmtiles,o", po::value<string>(&args->pmtiles),
+                    "save tiles as a PMTiles file; an interrupted run resumes "
+                    "from FILE.journal, which is removed once the file is complete")
+            ("archive,a", po::value<string>(&args->archive),
+                    "save tiles into a tar or zip file (by its extension), as "
+                    "uncompressed Z/X/Y.png entries; duplicates are hard links in "
+                    "a tar and share their image's entry in a zip. An interrupted "
+                    "run resumes from FILE.index, which is removed once the file "
+                    "is complete")
+            ("bulk", po::bool_switch(&args->bulk)->default_value(false),
+                    "with -m, tune the database for bulk loading: WAL journal, "
+                    "relaxed syncing, bigger pages and cache, and rows sorted "
+                    "by key before each batch is inserted")
+            ("defer-index", po::bool_switch(&args->defer_index)->default_value(false),
+                    "with -m, create the database without an index on the tiles "
+                    "table and build it once all tiles are written")
+            ("batch-size", po::value<int>(&args->batch_size)->default_value(10000),
+                    "with -m, number of tiles written per transaction")
+            ("write-buffer", po::value<string>(&args->write_buffer)->default_value("1G"),
+                    "with -m, -d or -a, memory for tiles waiting to be written (e.g. "
+                    "512M, 2G); rendering slows down to the writer's pace when it's "
+                    "full")
+            ("writers", po::value<int>(&args->writers)->default_value(4),
+                    "with -d, threads writing files when io_uring isn't available")
+            ("shards", po::value<int>(&args->shards)->default_value(0),
+                    "with -m, write tiles to this many databases in parallel "
+                    "(FILE.shard0, FILE.shard1, ...) and merge them into the "
+                    "MBTiles file at the end; the write buffer is split among them")
+            ("merge", po::bool_switch(&args->merge)->default_value(false),
+                    "with -m, merge the shards left by an interrupted run with "
+                    "--shards into the MBTiles file, then exit")
+            ("finalize", po::value<string>(&args->finalize)->default_value("vacuum"),
+                    "with -m, how to compact the MBTiles file at the end: none, "
+                    "incremental (give free pages back; the file must have been "
+                    "created with this mode), vacuum (rewrite it in place), "
+                    "rebuild (copy it into a new file ordered by zoom, column and "
+                    "row) or hilbert (the same, ordered by zoom and Hilbert index, "
+                    "so neighbouring tiles are stored together); with --merge, this "
+                    "can be applied to an existing file")
+            ("keep-idmap", po::bool_switch(&args->keep_idmap)->default_value(false),
+                    "with -m, keep the table of image hashes in the MBTiles file, "
+                    "so later runs on it keep deduplicating against its images")
             (",v", po::bool_switch(&args->verbose)->default_value(false),
                     "be verbose")
 
@@ -272,6 +690,20 @@ int parse_args(int argc, char *argv[], Args *args) {
     if (args->subdirs > 16)
         args->subdirs = 16;
 
+    if (args->metatile < 1)
+        args->metatile = 1;
+    if (args->metatile > 16)
+        args->metatile = 16;
+
+    if (args->run_length < 1)
+        args->run_length = 1;
+
+    if (args->window < 1)
+        args->window = 1;
+
+    if (args->processes < 0)
+        args->processes = 0;
+
     if (vm.count("help")) {
         cout << desc << endl;
         cout << "Input tiles file must be in the following format:" << endl;
@@ -281,23 +713,124 @@ int parse_args(int argc, char *argv[], Args *args) {
         cout << "  ..." << endl;
         cout << endl;
         cout << "This is the output format of tilestache-list" << endl;
+        cout << endl;
+        cout << "The input can also be a binary list of quadkeys, as saved" << endl;
+        cout << "by --save-quadkeys." << endl;
+        return 1;
+    }
+
+    if (vm.count("zoom") > 0) {
+        char c;
+        if (sscanf(args->zoom.c_str(), "%d-%d%c", &args->minzoom, &args->maxzoom, &c) != 2) {
+            if (sscanf(args->zoom.c_str(), "%d%c", &args->minzoom, &c) != 1) {
+                cout << "Invalid zoom range: " << args->zoom << " (use e.g. 0-14 or 12)" << endl;
+                return 1;
+            }
+            args->maxzoom = args->minzoom;
+        }
+        if (args->minzoom < 0 || args->maxzoom > 31 || args->minzoom > args->maxzoom) {
+            cout << "Invalid zoom range: " << args->zoom << " (levels go from 0 to 31)" << endl;
+            return 1;
+        }
+
+        double *b = args->bounds;
+        b[0] = -180; b[1] = -90; b[2] = 180; b[3] = 90;
+        if (vm.count("bbox") > 0) {
+            if (sscanf(args->bbox.c_str(), "%lf,%lf,%lf,%lf%c", &b[0], &b[1], &b[2], &b[3], &c) != 4
+                    || b[0] > b[2] || b[1] > b[3]) {
+                cout << "Invalid bounding box: " << args->bbox << " (use minlon,minlat,maxlon,maxlat)" << endl;
+                return 1;
+            }
+        }
+
+        if (vm.count("-i") > 0) {
+            cout << "Options -i and --zoom are exclusive" << endl;
+            cout << "See " << argv[0] << " -h" << endl;
+            return 1;
+        }
+    } else if (vm.count("bbox") > 0 || vm.count("coverage") > 0) {
+        cout << "Options --bbox and --coverage require --zoom" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (vm.count("skip-empty") > 0 && args->skip_empty != "envelope" && args->skip_empty != "query") {
+        cout << "Unknown --skip-empty mode: " << args->skip_empty << " (use envelope or query)" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (args->metatile & (args->metatile - 1)) {
+        cout << "Option --metatile must be a power of two" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (args->prune_solid && args->prune_layers.find_first_not_of(',') == string::npos) {
+        cout << "Option --prune-solid requires --prune-layers" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
         return 1;
     }
 
-    if (vm.count("-i") == 0) {
-        cout << "Input tiles file is required (one per line in Z/X/Y format)." << endl;
+    if (vm.count("prune-layers") > 0 && !args->prune_solid) {
+        cout << "Option --prune-layers requires --prune-solid" << endl;
         cout << "See " << argv[0] << " -h" << endl;
         return 1;
     }
 
+    if (args->finalize != "none" && args->finalize != "incremental" &&
+            args->finalize != "vacuum" && args->finalize != "rebuild" &&
+            args->finalize != "hilbert") {
+        cout << "Unknown --finalize mode: " << args->finalize
+             << " (use none, incremental, vacuum, rebuild or hilbert)" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (args->shards < 0) {
+        cout << "Invalid number of shards: " << args->shards << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (args->merge) {
+        if (vm.count("mbtiles") == 0) {
+            cout << "Option --merge requires -m" << endl;
+            cout << "See " << argv[0] << " -h" << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (vm.count("-i") == 0 && vm.count("zoom") == 0) {
+        cout << "Input tiles file (one per line in Z/X/Y format) or --zoom is required." << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (vm.count("save-quadkeys") > 0)
+        return 0;
+
     if (vm.count("-x") == 0) {
         cout << "You must supply a mapnik xml stylesheet with -x" << endl;
         cout << "See " << argv[0] << " -h" << endl;
         return 1;
     }
 
-    if (vm.count("-m") > 0 && vm.count("-d") > 0) {
-        cout << "Options -m and -d are exclusive" << endl;
+    if (args->order != "hilbert" && args->order != "shuffle") {
+        cout << "Unknown order: " << args->order << " (use hilbert or shuffle)" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if ((args->optimize ? 1 : 0) + vm.count("-p") + vm.count("-P") > 1) {
+        cout << "Options -O, -p and -P are exclusive" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    if (vm.count("mbtiles") + vm.count("pmtiles") + vm.count("archive") + vm.count("-d") > 1) {
+        cout << "Options -m, -o, -a and -d are exclusive" << endl;
         cout << "See " << argv[0] << " -h" << endl;
         return 1;
     }
@@ -324,6 +857,38 @@ string pretty(double seconds)
     return o.str();
 }
 
+string pretty_bytes(double bytes)
+{
+    const char *units = "BKMGT";
+    int i = 0;
+    while (bytes >= 1024 && units[i + 1]) {
+        bytes /= 1024;
+        i++;
+    }
+    std::ostringstream o;
+    o << std::fixed << std::setprecision(i > 0 ? 1 : 0) << bytes << units[i];
+    return o.str();
+}
+
+// Parses sizes like 4096, 512K, 64M or 2G
+bool parse_bytes(const string& s, size_t& bytes)
+{
+    char *end;
+    double n = strtod(s.c_str(), &end);
+    if (end == s.c_str() || n <= 0)
+        return false;
+    string unit(end);
+    const string units = "BKMGT";
+    size_t i = 0;
+    if (!unit.empty()) {
+        i = units.find(toupper(unit[0]));
+        if (i == string::npos || unit.size() > 1)
+            return false;
+    }
+    bytes = size_t(n * (1ULL << (10 * i)));
+    return true;
+}
+
 std::chrono::milliseconds operator""_ms(unsigned long long d)
 {
     return std::chrono::milliseconds(d);
@@ -335,23 +900,145 @@ int main(int argc, char *argv[])
     if (r != 0)
         return r;
 
+    size_t write_buffer;
+    if (!parse_bytes(args.write_buffer, write_buffer) ||
+            write_buffer < size_t(16 << 20) * std::max(1, args.shards)) {
+        cout << "Invalid --write-buffer: " << args.write_buffer
+             << " (it must be at least 16M, per shard with --shards)" << endl;
+        cout << "See " << argv[0] << " -h" << endl;
+        return 1;
+    }
+
+    MBTilesOptions mbtiles_options;
+    if (!args.mbtiles.empty()) {
+        mbtiles_options.bulk = args.bulk;
+        mbtiles_options.defer_index = args.defer_index;
+        mbtiles_options.batch_size = std::max(1, args.batch_size);
+        mbtiles_options.shards = args.shards;
+        mbtiles_options.write_buffer = write_buffer;
+        if (args.finalize == "none")
+            mbtiles_options.finalize = MBTilesOptions::Finalize::none;
+        else if (args.finalize == "incremental")
+            mbtiles_options.finalize = MBTilesOptions::Finalize::incremental;
+        else if (args.finalize == "rebuild")
+            mbtiles_options.finalize = MBTilesOptions::Finalize::rebuild;
+        else if (args.finalize == "hilbert")
+            mbtiles_options.finalize = MBTilesOptions::Finalize::hilbert;
+        mbtiles_options.keep_idmap = args.keep_idmap;
+    }
+
+    if (args.merge) {
+        try {
+            MBTilesTileStore::merge(args.mbtiles, mbtiles_options, args.verbose);
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::unique_ptr<TileSource> source;
+    try {
+        if (!args.zoom.empty())
+            source.reset(new CoverageTileSource(
+                    args.bounds, args.minzoom, args.maxzoom, args.coverage
+            ));
+        else
+            source = open_tile_source(args.input);
+        if (!args.save_quadkeys.empty()) {
+            save_quadkeys(*source, args.save_quadkeys);
+            return 0;
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
     const char *plugins_dir = "/usr/lib/mapnik/3.0/input";
     mapnik::datasource_cache::instance().register_datasources(plugins_dir);
 
-    std::shared_ptr<TileStore> store;
+    if (args.prune_solid) {
+        solid_tiles.reset(new SolidIndex());
+        std::istringstream layers(args.prune_layers);
+        string layer;
+        while (std::getline(layers, layer, ','))
+            if (!layer.empty())
+                prune_layers.insert(layer);
+    }
 
-    if (!args.mbtiles.empty()) {
-        store = std::make_shared<MBTilesTileStore>(
-                args.mbtiles, args.verbose
-        );
+    if (!args.skip_empty.empty()) {
+        skip_empty = true;
+        skip_empty_mode = args.skip_empty == "query" ? LayerProbe::query : LayerProbe::envelope;
+    }
+
+    // The stylesheet is loaded once and render threads get copies of the
+    // map. Workers load it themselves after being forked, which happens
+    // before the store, the optimizer or the coprocesses start any threads
+    // or processes of their own; the main process doesn't load it at all.
+    Map map;
+    vector<std::unique_ptr<Map>> thread_maps;
+    std::unique_ptr<RenderWorkers> workers;
+    int thread_count = args.processes > 0 ? args.processes : args.threads;
+    try {
+        if (args.processes > 0) {
+            allocate_counters(2 * thread_count);
+            const string& xml = args.xml;
+            workers.reset(new RenderWorkers(thread_count, [&xml](int index, WorkerChannel& channel) {
+                render_worker(xml, index, channel);
+            }));
+            if (args.verbose)
+                printf("Started %d render workers\n", thread_count);
+        } else {
+            auto load_start = std::chrono::steady_clock::now();
+            mapnik::load_map(map, args.xml);
+            std::chrono::duration<double> loaded = std::chrono::steady_clock::now() - load_start;
+
+            auto copy_start = std::chrono::steady_clock::now();
+            allocate_counters(thread_count);
+            for (int i=0; i<thread_count; i++)
+                thread_maps.push_back(copy_map(map));
+            std::chrono::duration<double> copied = std::chrono::steady_clock::now() - copy_start;
+
+            if (args.verbose) {
+                printf("Loaded %s in %.3fs; copied it for %d render threads in %.3fs\n",
+                       args.xml.c_str(), loaded.count(), thread_count, copied.count());
+            }
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
     }
-    if (!args.output_dir.empty()) {
-        store = std::make_shared<DirectoryTileStore>(
-                args.output_dir, args.subdirs, args.verbose
-        );
+
+    std::shared_ptr<TileStore> store;
+
+    try {
+        if (!args.mbtiles.empty()) {
+            store = std::make_shared<MBTilesTileStore>(
+                    args.mbtiles, args.verbose, mbtiles_options
+            );
+        }
+        if (!args.pmtiles.empty()) {
+            store = std::make_shared<PMTilesTileStore>(
+                    args.pmtiles, args.verbose
+            );
+        }
+        if (!args.archive.empty()) {
+            store = std::make_shared<ArchiveTileStore>(
+                    args.archive, args.verbose, write_buffer
+            );
+        }
+        if (!args.output_dir.empty()) {
+            store = std::make_shared<DirectoryTileStore>(
+                    args.output_dir, args.subdirs, args.verbose,
+                    write_buffer, std::max(1, args.writers)
+            );
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
     }
     if (!store) {
-        cout << "You must specify a place to save tiles to (-m or -d)" << endl;
+        cout << "You must specify a place to save tiles to (-m, -o, -a or -d)" << endl;
         cout << "See " << argv[0] << " -h" << endl;
         return 1;
     }
@@ -361,41 +1048,39 @@ int main(int argc, char *argv[])
         store->tempdir(args.tempdir);
     }
 
-    string line;
-    std::ifstream input(args.input);
-    while (true) {
-        std::getline(input, line);
-        if (input.eof())
-            break;
-        std::istringstream linestream(line);
-        int x,y,z; char c,d;
-        linestream >> z >> c >> x >> d >> y;
-        if (linestream.fail() || c != '/' || d != '/') {
-            cerr << "error parsing line: " << line << endl;
-            cerr << "input lines must be in Z/X/Y format" << endl;
+    if (args.optimize) {
+        int n = args.optimize_threads;
+        if (n <= 0)
+            n = std::max(1u, std::thread::hardware_concurrency());
+        store->optimizer(std::make_shared<PngOptimizer>(n));
+    }
+
+    if (!args.coprocess.empty()) {
+        int n = args.postprocessors;
+        if (n <= 0)
+            n = std::max(1u, std::thread::hardware_concurrency());
+        try {
+            store->coprocesses(std::make_shared<CoprocessPool>(args.coprocess, n));
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
             return 1;
         }
-        tiles.push_back({x,y,z});
     }
 
-    // this makes the ETA more stable
-    // and we intentionally won't seed it, so that
-    // if you interrupt a run, the next one will
-    // skip all the already rendered tiles first,
-    // since the random order will be the same
-    std::random_shuffle(tiles.begin(), tiles.end());
+    scheduler.reset(new Scheduler(
+            *source, args.metatile, args.order, args.run_length, args.window,
+            args.prune_solid
+    ));
 
-    tilecount = 0;
     finished_threads = 0;
 
-    rendered_tiles = 0;
-    next_tile = tiles.begin();
-
-    int thread_count = args.threads;
     std::thread threads[thread_count];
 
     for (int i=0; i<thread_count; i++) {
-        threads[i] = std::thread { render_thread, store, args.xml };
+        if (workers)
+            threads[i] = std::thread { worker_feed_thread, store, std::ref(workers->channel(i)), i };
+        else
+            threads[i] = std::thread { render_thread, store, std::ref(*thread_maps[i]), i };
     }
 
     //std::chrono::milliseconds d(1000);
@@ -404,7 +1089,7 @@ int main(int argc, char *argv[])
     //auto e = 100_ms;
 
 
-    int total_tiles = tiles.size();
+    long total_tiles = scheduler->total();
     int moveup = 1; bool first = true;
     while (true)
     {
@@ -419,22 +1104,33 @@ int main(int argc, char *argv[])
         }
         first = false;
 
-        double speed = rendered_tiles / elapsed.count();
+        long processed = total_processed();
+        long rendered = total_rendered();
+        double speed = rendered / elapsed.count();
         double eta = -1;
         if (speed != 0)
-            eta = 1 + (total_tiles - tilecount) / speed;
+            eta = 1 + (total_tiles - processed) / speed;
 
-        printf("Total: %d  Processed: %d  Rendered: %d  Unique: %d\n",
-               total_tiles, int(tilecount),
-               int(rendered_tiles), store->unique_tiles());
+        printf("Total: %ld  Processed: %ld  Rendered: %ld  Unique: %d  Solid: %ld",
+               total_tiles, processed,
+               rendered, store->unique_tiles(), total_solid());
+        if (args.prune_solid)
+            printf("  Pruned: %ld", total_pruned());
+        if (skip_empty)
+            printf("  Empty: %ld (%ld renders skipped)", total_empty(), total_skipped_renders());
+        printf("\n");
 
         printf("Speed: %.1f  ", speed);
         cout << "Elapsed: " << pretty(elapsed.count()) << "  "
              << "ETA: " << pretty(eta);
 
-        if (!args.mbtiles.empty()) {
-            const MBTilesTileStore* s = static_cast<MBTilesTileStore*>(store.get());
-            printf("\nWrite queue: %d tiles", s->queue_size());
+        long queued;
+        size_t queued_bytes;
+        double stalled;
+        if (store->write_queue(queued, queued_bytes, stalled)) {
+            printf("\nWrite queue: %ld entries, %s of %s  Stalled: %s\033[K",
+                   queued, pretty_bytes(queued_bytes).c_str(),
+                   args.write_buffer.c_str(), pretty(stalled).c_str());
             moveup = 2;
         }
 
@@ -445,6 +1141,17 @@ int main(int argc, char *argv[])
 
     for (auto& t: threads)
         t.join();
+    workers.reset();
+
+    std::chrono::duration<double> total = std::chrono::system_clock::now() - start;
+    printf("Rendered %ld tiles in %s (%.1f tiles/s, order: %s)\n",
+           total_rendered(), pretty(total.count()).c_str(),
+           total_rendered() / total.count(), args.order.c_str());
 
+    if (dead_workers > 0) {
+        cerr << dead_workers << " of " << thread_count << " render workers died; "
+             << "the tiles they skipped are rendered by running again" << endl;
+        return 1;
+    }
     return 0;
 }
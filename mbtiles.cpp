@@ -15,8 +15,17 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <boost/filesystem.hpp>
 
 #include "mbtiles.h"
+#include "hilbert.h"
+#include "pngoptimizer.h"
 
 using std::string;
 using std::cout;
@@ -27,28 +36,53 @@ using std::mutex;
 using std::lock_guard;
 using std::unique_lock;
 
-/* NOTE: This class will fail if zoom levels higher than 28 are used
- * because of the optimization used by alreadyRendered to store the set
- * of rendered tiles.
- */
-MBTilesTileStore::MBTilesTileStore(const string &mbtiles_file, bool verbose)
-    : mbtiles_file(mbtiles_file), verbose(verbose)
+namespace fs = boost::filesystem;
+
+// Reads a digest stored as a blob, or as hex text by earlier versions
+static bool column_digest(sqlite3_stmt *stmt, int column, md5digest &digest)
 {
-    int rc;
-    rc = sqlite3_open(mbtiles_file.c_str(), &db);
-    if (rc != 0)
-    {
-        sqlite3_close(db);
-         std::runtime_error("Error opening database");
+    // the type has to be read before the value, which may convert it
+    int type = sqlite3_column_type(stmt, column);
+    const void *blob = sqlite3_column_blob(stmt, column);
+    int size = sqlite3_column_bytes(stmt, column);
+    if (type == SQLITE_BLOB) {
+        if (size != sizeof(digest))
+            return false;
+        memcpy(&digest, blob, sizeof(digest));
+        return true;
     }
+    if (size != 2 * sizeof(digest))
+        return false;
+    const char *hex = static_cast<const char *>(blob);
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(&digest);
+    for (size_t i=0; i<sizeof(digest); i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return false;
+        bytes[i] = byte;
+    }
+    return true;
+}
+
+// Tables of a new database; existing ones are left as they are
+static void create_tables(sqlite3 *db, bool defer_index)
+{
+    int rc;
     char *errmsg;
-    rc = sqlite3_exec(db,
+
+    // With a deferred index, map is a plain table while tiles are added
+    // and map_index is built when closing. Existing databases keep the
+    // layout they were created with.
+    string map_table = defer_index ?
         R"sql(
-        CREATE TABLE IF NOT EXISTS metadata (
-            name TEXT,
-            value TEXT,
-            PRIMARY KEY (name)
+        CREATE TABLE IF NOT EXISTS map (
+            zoom INTEGER,
+            col INTEGER,
+            row INTEGER,
+            tile_id INTEGER
         );
+        )sql" :
+        R"sql(
         CREATE TABLE IF NOT EXISTS map (
             zoom INTEGER,
             col INTEGER,
@@ -56,6 +90,21 @@ MBTilesTileStore::MBTilesTileStore(const string &mbtiles_file, bool verbose)
             tile_id INTEGER,
             PRIMARY KEY (zoom, col, row)
         ) WITHOUT ROWID;
+        )sql";
+    rc = sqlite3_exec(db, map_table.c_str(), nullptr, nullptr, &errmsg);
+    if (rc != 0)
+    {
+        cerr << "Error while creating db: " << errmsg << endl;
+        throw std::runtime_error("Error initializing database");
+    }
+
+    rc = sqlite3_exec(db,
+        R"sql(
+        CREATE TABLE IF NOT EXISTS metadata (
+            name TEXT,
+            value TEXT,
+            PRIMARY KEY (name)
+        );
         CREATE TABLE IF NOT EXISTS images (
             tile_id INTEGER PRIMARY KEY,
             tile_data BLOB
@@ -69,9 +118,9 @@ MBTilesTileStore::MBTilesTileStore(const string &mbtiles_file, bool verbose)
             FROM map
             JOIN images ON images.tile_id = map.tile_id;
         CREATE TABLE IF NOT EXISTS idmap (
-            md5 TEXT,
+            md5 BLOB PRIMARY KEY,
             tile_id INTEGER
-        );
+        ) WITHOUT ROWID;
         )sql",
         nullptr,
         nullptr,
@@ -83,9 +132,83 @@ MBTilesTileStore::MBTilesTileStore(const string &mbtiles_file, bool verbose)
         //cout << "sqlite3_exec returned " << rc << endl;
         throw std::runtime_error("Error initializing database");
     }
-    load_ids();
-    load_rendered_tiles();
+}
 
+MBTilesWriter::MBTilesWriter(const string &file, const MBTilesOptions &options,
+                             size_t write_buffer, bool verbose)
+    : file(file), options(options), verbose(verbose), insert_queue(write_buffer)
+{
+    int rc;
+    rc = sqlite3_open(file.c_str(), &db);
+    if (rc != 0)
+    {
+        sqlite3_close(db);
+        throw std::runtime_error("Error opening database " + file);
+    }
+    char *errmsg;
+
+    if (options.bulk) {
+        // page_size only applies to new databases (or after a VACUUM).
+        // WAL with synchronous=NORMAL keeps every committed batch safe
+        // from crashes without syncing on each commit.
+        rc = sqlite3_exec(db,
+            R"sql(
+            PRAGMA page_size = 32768;
+            PRAGMA journal_mode = WAL;
+            PRAGMA synchronous = NORMAL;
+            PRAGMA cache_size = -262144;
+            PRAGMA temp_store = MEMORY;
+            )sql",
+            nullptr, nullptr, &errmsg
+        );
+        if (rc != 0)
+        {
+            cerr << "Error setting up database for bulk writes: " << errmsg << endl;
+            throw std::runtime_error("Error initializing database");
+        }
+    }
+
+    // auto_vacuum can only be chosen before the first table is created
+    if (options.finalize == MBTilesOptions::Finalize::incremental &&
+            sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;", nullptr, nullptr, &errmsg)) {
+        cerr << "Error enabling incremental vacuum: " << errmsg << endl;
+        sqlite3_free(errmsg);
+    }
+
+    create_tables(db, options.defer_index);
+}
+
+MBTilesWriter::~MBTilesWriter()
+{
+    stop();
+    close_db();
+}
+
+void MBTilesWriter::load(IdMap &idmap, int &max_id,
+                         TileIndex &rendered)
+{
+    load_ids(idmap, max_id);
+    if (map_indexed()) {
+        load_rendered_tiles(rendered);
+    } else {
+        load_rendered_tiles_scan(rendered);
+    }
+
+    if (options.defer_index) {
+        // the index only helped loading; it's rebuilt when finalizing
+        char *errmsg;
+        if (sqlite3_exec(db, "DROP INDEX IF EXISTS map_index;", nullptr, nullptr, &errmsg))
+            cerr << "Error dropping index map_index: " << errmsg << endl;
+        if (map_indexed()) {
+            if (verbose)
+                cout << "The map table has a primary key, its index can't be deferred." << endl;
+            options.defer_index = false;
+        }
+    }
+}
+
+void MBTilesWriter::start()
+{
     std::thread t {[this]() {
         write_loop();
     }};
@@ -93,27 +216,27 @@ MBTilesTileStore::MBTilesTileStore(const string &mbtiles_file, bool verbose)
     write_thread = std::move(t);
 }
 
-MBTilesTileStore::~MBTilesTileStore()
-{
-    close();
-}
-
-void MBTilesTileStore::load_ids()
+// Ids also come from images, since idmap is dropped when a database is
+// finalized and new images must not reuse the ids of the ones left.
+// Digests are 16 byte blobs; databases from earlier versions have them as
+// hex text, and those are read too.
+void MBTilesWriter::load_ids(IdMap &idmap, int &max_id)
 {
     sqlite3_stmt *stmt;
     if (sqlite3_prepare_v2(db, "SELECT md5, tile_id FROM idmap;", -1, &stmt, nullptr) != SQLITE_OK)
         db_error("error preparing select from idmap query");
 
-    if (verbose) cout << "Loading tile id's from database... ";
+    if (verbose) cout << "Loading tile id's from " << file << "... ";
     int rc;
-    next_tile_id = -1;
     while (true) {
         rc = sqlite3_step(stmt);
         if (rc == SQLITE_ROW) {
-            const char *hash = (const char *)sqlite3_column_text(stmt, 0);
+            md5digest digest;
+            if (!column_digest(stmt, 0, digest))
+                continue;
             int tile_id = sqlite3_column_int(stmt, 1);
-            idmap.insert({hash, tile_id});
-            next_tile_id = std::max(next_tile_id, tile_id);
+            idmap.insert(digest, tile_id);
+            max_id = std::max(max_id, tile_id);
         } else if (rc == SQLITE_DONE) {
             break;
         }
@@ -121,179 +244,265 @@ void MBTilesTileStore::load_ids()
             db_error("error stepping through idmap table");
         }
     }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(db, "SELECT MAX(tile_id) FROM images;", -1, &stmt, nullptr) != SQLITE_OK)
+        db_error("error preparing select from images query");
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+        max_id = std::max(max_id, sqlite3_column_int(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW)
+        db_error("error reading the largest image id");
 
-    next_tile_id++;
     if (verbose) cout << "done." << endl;
+}
 
-//    for (const auto& pair : idmap) {
-//        cout << "  " << pair.first << ", " << pair.second << endl;
-//    }
+// Each zoom level is read by its own connection, and the levels are
+// spread over as many threads as there are cores. Queries by zoom use
+// the primary key of map, so every thread reads a separate range of it.
+void MBTilesWriter::load_rendered_tiles(TileIndex &rendered)
+{
+    if (verbose) cout << "Loading rendered tiles from " << file << "... ";
 
-//    std::chrono::milliseconds d(2000);
-//    std::this_thread::sleep_for(d);
+    std::atomic_int next_zoom { 0 };
+    std::atomic_bool failed { false };
+    auto load_zooms = [this, &rendered, &next_zoom, &failed]() {
+        sqlite3 *conn;
+        if (sqlite3_open_v2(file.c_str(), &conn, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            cerr << "error opening database: " << sqlite3_errmsg(conn) << endl;
+            sqlite3_close(conn);
+            failed = true;
+            return;
+        }
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(conn, "SELECT col, row FROM map WHERE zoom = ?;", -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << "error preparing select from map query: " << sqlite3_errmsg(conn) << endl;
+            sqlite3_close(conn);
+            failed = true;
+            return;
+        }
 
-    sqlite3_finalize(stmt);
+        int z;
+        while (!failed && (z = next_zoom++) < 32) {
+            sqlite3_reset(stmt);
+            sqlite3_bind_int(stmt, 1, z);
+            int rc;
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                tile t;
+                t.z = z;
+                t.x = sqlite3_column_int(stmt, 0);
+                t.y = sqlite3_column_int(stmt, 1);
+                rendered.insert(t);
+            }
+            if (rc != SQLITE_DONE) {
+                cerr << "error stepping through map table: " << sqlite3_errmsg(conn) << endl;
+                failed = true;
+            }
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_close(conn);
+    };
+
+    int thread_count = std::max(1u, std::min(32u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (int i=0; i<thread_count; i++)
+        threads.emplace_back(load_zooms);
+    for (auto& t: threads)
+        t.join();
+
+    if (failed)
+        throw std::runtime_error("database error");
+
+    if (verbose) cout << "done (" << rendered.size() << " tiles)." << endl;
 }
 
-void MBTilesTileStore::load_rendered_tiles()
+// Without an index on map, each query by zoom would scan the whole table,
+// so the tiles are read in a single pass instead.
+void MBTilesWriter::load_rendered_tiles_scan(TileIndex &rendered)
 {
+    if (verbose) cout << "Loading rendered tiles from " << file << " (no index on map)... ";
+
     sqlite3_stmt *stmt;
     if (sqlite3_prepare_v2(db, "SELECT zoom, col, row FROM map;", -1, &stmt, nullptr) != SQLITE_OK)
-        db_error("error preparing select from idmap query");
-
-    if (verbose) cout << "Loading rendered tiles from database... ";
+        db_error("error preparing select from map query");
     int rc;
-    while (true) {
-        rc = sqlite3_step(stmt);
-        if (rc == SQLITE_ROW) {
-            uint64_t z = sqlite3_column_int(stmt, 0);
-            uint64_t x = sqlite3_column_int(stmt, 1);
-            uint64_t y = sqlite3_column_int(stmt, 2);
-            rendered_tiles.insert((z << 58)|(x << 29)|y);
-        } else if (rc == SQLITE_DONE) {
-            break;
-        } else {
-            db_error("error stepping through map table");
-        }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        tile t;
+        t.z = sqlite3_column_int(stmt, 0);
+        t.x = sqlite3_column_int(stmt, 1);
+        t.y = sqlite3_column_int(stmt, 2);
+        rendered.insert(t);
     }
-
-    if (verbose) cout << "done." << endl;
-//    for (uint64_t t : rendered_tiles) {
-//        int z = (int)(t >> 58);
-//        int x = (int)((t >> 29) & 0x1fffffff);
-//        int y = (int)(t & 0x1fffffff);
-//        cout << "already rendered: " << t
-//             << "(" << z << "/" << x << "/" << y << ")" << endl;
-//    }
     sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+        db_error("error stepping through map table");
+
+    if (verbose) cout << "done (" << rendered.size() << " tiles)." << endl;
 }
 
-bool MBTilesTileStore::alreadyRendered(const tile &t)
+// Whether map has a primary key or map_index
+bool MBTilesWriter::map_indexed()
 {
-    uint64_t z = t.z;
-    uint64_t x = t.x;
-    uint64_t y = t.y;
-    auto it = rendered_tiles.find((z << 58)|(x << 29)|y);
-
-    if (it == rendered_tiles.end())
-    {
-        return false;
-    }
-    return true;
-
-//    if (select_id_from_map == nullptr) {
-//        if (sqlite3_prepare_v2(db, "SELECT tile_id FROM map WHERE "
-//                               "zoom = ? AND col = ? AND row = ?;",
-//                               -1, &select_id_from_map, nullptr) != SQLITE_OK)
-//            db_error("error preparing select from map query");
-//    } else {
-//        if (sqlite3_reset(select_id_from_map) != SQLITE_OK)
-//            db_error("error resetting select from map query");
-//    }
-
-//    if (sqlite3_bind_int(select_id_from_map, 1, t.z) != SQLITE_OK)
-//        db_error("error binding insert into map query");
-//    if (sqlite3_bind_int(select_id_from_map, 2, t.x) != SQLITE_OK)
-//        db_error("error binding insert into map query");
-//    if (sqlite3_bind_int(select_id_from_map, 3, t.y) != SQLITE_OK)
-//        db_error("error binding insert into map query");
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA index_list(map);", -1, &stmt, nullptr) != SQLITE_OK)
+        db_error("error preparing index list query");
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        db_error("error listing indexes of map");
+    return rc == SQLITE_ROW;
+}
 
-//    int rc = sqlite3_step(select_id_from_map);
-//    if (!(rc == SQLITE_ROW || rc == SQLITE_DONE))
-//        db_error("error stepping through query");
+void MBTilesWriter::build_index()
+{
+    if (verbose)
+        cout << "Indexing map table." << endl;
 
-//    bool result = false;
-//    if (rc == SQLITE_ROW)
-//       result = true;
+    const char *create = "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom, col, row);";
+    char *errmsg;
+    if (sqlite3_exec(db, create, nullptr, nullptr, &errmsg) == SQLITE_OK)
+        return;
+    sqlite3_free(errmsg);
 
-//    return result;
+    // Nothing stopped the same tile from being added twice (e.g. if it
+    // was listed twice in the input); keep the last one.
+    if (sqlite3_exec(db,
+            "DELETE FROM map WHERE rowid NOT IN "
+            "(SELECT MAX(rowid) FROM map GROUP BY zoom, col, row);",
+            nullptr, nullptr, &errmsg)) {
+        cerr << "Error removing duplicate tiles from map: " << errmsg << endl;
+        sqlite3_free(errmsg);
+        return;
+    }
+    if (sqlite3_exec(db, create, nullptr, nullptr, &errmsg)) {
+        cerr << "Error indexing map table: " << errmsg << endl;
+        sqlite3_free(errmsg);
+    }
 }
 
-void MBTilesTileStore::db_error(const string& msg)
+void MBTilesWriter::db_error(const string& msg)
 {
     cerr << msg << ": " << sqlite3_errmsg(db) << endl;
     throw std::runtime_error("database error");
 }
 
-void MBTilesTileStore::write_loop()
+// Takes up to batch_size operations from the queue at a time and writes
+// each batch in its own transaction, so commits (and WAL checkpoints) come
+// at a steady pace however far behind the writer is. A batch stays in the
+// queue (and counts against its size) until it's committed.
+void MBTilesWriter::write_loop()
 {
-    unique_lock<mutex> lock(write_cond_m);
-
+    std::vector<InsertOp> batch;
+    batch.reserve(options.batch_size);
     while (true) {
-        sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
-        _queue_size = insert_queue.size();
-        while (!insert_queue.empty()) {
-            _finished = false;
-            const InsertOp& op = insert_queue.front();
-            exec(op);
-            insert_queue_mutex.lock();
-            insert_queue.pop();
-            insert_queue_mutex.unlock();
+        if (insert_queue.take(batch, options.batch_size) > 0) {
+            write_batch(batch);
+            batch.clear();
+            insert_queue.release();
+            continue;
         }
 
-        sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
-        _finished = true;
-
         // ran out of tiles to write
         // I'll wait until someone wakes me up
-        if (closing)
+        unique_lock<mutex> lock(write_cond_m);
+        write_cond.wait(lock, [this]() { return closing || !insert_queue.empty(); });
+        if (closing && insert_queue.empty())
             break;
-        else
-            write_cond.wait(lock);
     }
 }
 
-void MBTilesTileStore::exec(const InsertOp &op)
+void MBTilesWriter::write_batch(std::vector<InsertOp> &batch)
+{
+    sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
+    if (!options.bulk) {
+        for (const InsertOp& op: batch)
+            exec(op);
+    } else {
+        // Inserting in key order touches each b-tree page once per batch
+        // instead of once per row: new images first (ids only grow), then
+        // the tiles by zoom, column and row.
+        std::sort(batch.begin(), batch.end(), [](const InsertOp& a, const InsertOp& b) {
+            if (a.t.z != b.t.z) return a.t.z < b.t.z;
+            if (a.t.x != b.t.x) return a.t.x < b.t.x;
+            return a.t.y < b.t.y;
+        });
+        std::vector<const InsertOp*> images;
+        for (const InsertOp& op: batch)
+            if (op.data_size > 0)
+                images.push_back(&op);
+        std::sort(images.begin(), images.end(), [](const InsertOp* a, const InsertOp* b) {
+            return a->id < b->id;
+        });
+        for (const InsertOp* op: images)
+            exec_image(*op);
+        for (const InsertOp& op: batch)
+            exec_map(op);
+    }
+    sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+}
+
+void MBTilesWriter::exec(const InsertOp &op)
+{
+    if (op.data_size > 0)
+        exec_image(op);
+    exec_map(op);
+}
+
+void MBTilesWriter::exec_image(const InsertOp &op)
 {
-    const tile& t = op.t;
-    const string& data = op.data;
     int tile_id = op.id;
-    const string& hash = op.hash;
 
     int rc;
 
-    if (!data.empty()) {
-        if (insert_into_idmap == nullptr) {
-            if (sqlite3_prepare_v2(db,
-                    "INSERT INTO idmap VALUES(?, ?);", -1,
-                    &insert_into_idmap, nullptr
-                ) != SQLITE_OK) {
-                db_error("error preparing 'insert into idmap' query");
-            }
-        } else {
-            if (sqlite3_reset(insert_into_idmap) != SQLITE_OK)
-                db_error("error resetting 'insert into idmap' query");
-        }
-        if (sqlite3_bind_text(insert_into_idmap, 1, hash.c_str(), hash.size(), SQLITE_STATIC) != SQLITE_OK)
-            db_error("error binding insert into idmap query");
-        if (sqlite3_bind_int(insert_into_idmap, 2, tile_id) != SQLITE_OK)
-            db_error("error binding insert into idmap query");
-
-        rc = sqlite3_step(insert_into_idmap);
-        if (rc != SQLITE_DONE)
-            db_error("error stepping through 'insert into idmap' query");
-
-
-        if (insert_into_images == nullptr) {
-            if (sqlite3_prepare_v2(db,
-                    "INSERT INTO images VALUES(?, ?);", -1,
-                    &insert_into_images, nullptr
-                ) != SQLITE_OK) {
-                db_error("error preparing 'insert into images' query");
-            }
-        } else {
-            if (sqlite3_reset(insert_into_images) != SQLITE_OK)
-                db_error("error resetting 'insert into images' query");
+    if (insert_into_idmap == nullptr) {
+        if (sqlite3_prepare_v2(db,
+                "INSERT INTO idmap VALUES(?, ?);", -1,
+                &insert_into_idmap, nullptr
+            ) != SQLITE_OK) {
+            db_error("error preparing 'insert into idmap' query");
         }
-        if (sqlite3_bind_int(insert_into_images, 1, tile_id) != SQLITE_OK)
-            db_error("error binding insert into images query");
-        if (sqlite3_bind_blob(insert_into_images, 2, data.c_str(), data.size(), SQLITE_STATIC) != SQLITE_OK)
-            db_error("error binding insert into images query");
+    } else {
+        if (sqlite3_reset(insert_into_idmap) != SQLITE_OK)
+            db_error("error resetting 'insert into idmap' query");
+    }
+    if (sqlite3_bind_blob(insert_into_idmap, 1, op.hash, op.hash_size, SQLITE_STATIC) != SQLITE_OK)
+        db_error("error binding insert into idmap query");
+    if (sqlite3_bind_int(insert_into_idmap, 2, tile_id) != SQLITE_OK)
+        db_error("error binding insert into idmap query");
+
+    rc = sqlite3_step(insert_into_idmap);
+    if (rc != SQLITE_DONE)
+        db_error("error stepping through 'insert into idmap' query");
+
 
-        rc = sqlite3_step(insert_into_images);
-        if (rc != SQLITE_DONE)
-            db_error("error stepping through 'insert into images' query");
+    if (insert_into_images == nullptr) {
+        if (sqlite3_prepare_v2(db,
+                "INSERT INTO images VALUES(?, ?);", -1,
+                &insert_into_images, nullptr
+            ) != SQLITE_OK) {
+            db_error("error preparing 'insert into images' query");
+        }
+    } else {
+        if (sqlite3_reset(insert_into_images) != SQLITE_OK)
+            db_error("error resetting 'insert into images' query");
     }
+    if (sqlite3_bind_int(insert_into_images, 1, tile_id) != SQLITE_OK)
+        db_error("error binding insert into images query");
+    if (sqlite3_bind_blob(insert_into_images, 2, op.data, op.data_size, SQLITE_STATIC) != SQLITE_OK)
+        db_error("error binding insert into images query");
+
+    rc = sqlite3_step(insert_into_images);
+    if (rc != SQLITE_DONE)
+        db_error("error stepping through 'insert into images' query");
+}
+
+void MBTilesWriter::exec_map(const InsertOp &op)
+{
+    const tile& t = op.t;
+    int tile_id = op.id;
+
+    int rc;
 
     //cout << "idmap[" << hash << "] = " << tile_id << endl;
     if (insert_into_map == nullptr) {
@@ -324,92 +533,607 @@ void MBTilesTileStore::exec(const InsertOp &op)
 //        return StoreResult::Duplicate;
 }
 
-void MBTilesTileStore::storeTile(const tile &t, string &&data)
+double MBTilesWriter::push(const tile &t, int tile_id, const string &data, const string &hash)
 {
-    auto hash = md5(data);
+    double waited = insert_queue.push(t, tile_id, data, hash);
+    // taking the lock makes sure the writer is either waiting or
+    // hasn't checked the queue yet, so the notification isn't lost
+    lock_guard<mutex> write_cond_guard { write_cond_m };
+    write_cond.notify_one();
+    return waited;
+}
 
-    int tile_id;
-    bool write_data;
+void MBTilesWriter::stop()
+{
+    if (!write_thread.joinable())
+        return;
 
     {
-        lock_guard<mutex> guard { idmap_mutex };
-
-        auto it = idmap.find(hash);
-        if (it == idmap.end())
-        {
-            tile_id = next_tile_id;
-            next_tile_id++;
-            _unique_tiles++;
-//            cout << "inserting " << hash << ", " << tile_id << " to idmap" << endl;
-            idmap.insert({hash, tile_id});
-            write_data = true;
-        } else {
-            tile_id = it->second;
-            write_data = false;
-        }
+        lock_guard<mutex> write_cond_guard { write_cond_m };
+        closing = true;
     }
+    write_cond.notify_one();
+    write_thread.join();
+}
 
-    string d;
-    if (write_data) {
-        if (postprocess_command.empty()) {
-            d = std::move(data);
-        } else {
-            d = do_postprocess(data, hash + ".png");
-            if (d.empty())
-            {
-                // We'll assume an empty result means an error
-                cerr << "Postprocessing " << hash << ".png yielded 0 bytes, not storing it" << endl;
-                return;
-            }
-        }
+// Images keep their ids (they're unique across shards), a tile copied
+// again replaces itself and a hash copied again is ignored, which is what
+// makes merging a shard twice harmless.
+void MBTilesWriter::merge(const string &shard)
+{
+    char *attach = sqlite3_mprintf("ATTACH DATABASE %Q AS shard;", shard.c_str());
+    char *errmsg;
+    int rc = sqlite3_exec(db, attach, nullptr, nullptr, &errmsg);
+    sqlite3_free(attach);
+    if (rc != SQLITE_OK) {
+        cerr << "Error attaching " << shard << ": " << errmsg << endl;
+        throw std::runtime_error("Error merging shards");
     }
 
-    {
-        lock_guard<mutex> guard { insert_queue_mutex };
-        //cout << "data.length = " << data.length() << endl;
-        //cout << "before inserting data.c_str() was " << (void*)(&(data.at(0))) << endl;
-        //auto op = InsertOp(t, data);
-        //cout << "after constructing op, first byte is at " << (void*)(&(op.data.at(0))) << endl;
-//        cout << "adding tile " << t << " with id " << tile_id << " to the insertion queue" << endl;
-        if (write_data)
-            insert_queue.emplace(t, std::move(d), tile_id, hash);
-        else
-            insert_queue.emplace(t, "", tile_id, "");
-        //cout << "after inserting, insert_queue.back().data.at(0) is " << (void*)(&(insert_queue.back().data.at(0))) << endl;
-        //cout << (void*)(data.c_str()) << endl;
-        //cout << data.empty() << endl;
-        //lock_guard<mutex> write_cond_guard { write_cond_m };
+    rc = sqlite3_exec(db,
+        R"sql(
+        BEGIN;
+        INSERT OR IGNORE INTO images SELECT tile_id, tile_data FROM shard.images;
+        INSERT OR REPLACE INTO map SELECT zoom, col, row, tile_id FROM shard.map;
+        INSERT OR IGNORE INTO idmap SELECT md5, tile_id FROM shard.idmap;
+        COMMIT;
+        )sql",
+        nullptr, nullptr, &errmsg
+    );
+    if (rc != SQLITE_OK) {
+        cerr << "Error merging " << shard << ": " << errmsg << endl;
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
     }
-    write_cond.notify_one();
+    sqlite3_exec(db, "DETACH DATABASE shard;", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+        throw std::runtime_error("Error merging shards");
 }
 
-void MBTilesTileStore::close()
+void MBTilesWriter::finalize()
 {
-    closing = true;
-    write_cond.notify_one();
-    write_thread.join();
     if (verbose)
     {
-        cout << "Cleaning up, vacuuming & closing database." << endl;
+        cout << "Cleaning up & closing database." << endl;
     }
 
+    // a merged database may have duplicates in a deferred map table too
+    if (!map_indexed())
+        build_index();
+
     char *errmsg;
-    if (sqlite3_exec(db, "DROP TABLE idmap;", nullptr, nullptr, &errmsg))
+    if (!options.keep_idmap && sqlite3_exec(db, "DROP TABLE IF EXISTS idmap;", nullptr, nullptr, &errmsg)) {
         cerr << "Error dropping table idmap: " << errmsg << endl;
+        sqlite3_free(errmsg);
+    }
 
-    if (sqlite3_exec(db, "VACUUM;", nullptr, nullptr, &errmsg))
-        cerr << "Error vacuuming database: " << errmsg << endl;
+    switch (options.finalize) {
+    case MBTilesOptions::Finalize::none:
+        break;
+    case MBTilesOptions::Finalize::incremental:
+        incremental_vacuum();
+        break;
+    case MBTilesOptions::Finalize::vacuum:
+        vacuum();
+        break;
+    case MBTilesOptions::Finalize::rebuild:
+    case MBTilesOptions::Finalize::hilbert:
+        // the rebuilt file has replaced this one, already closed
+        if (rebuild())
+            return;
+        break;
+    }
+
+    // leave a single file behind, as MBTiles readers expect
+    if (options.bulk && sqlite3_exec(db, "PRAGMA journal_mode = DELETE;", nullptr, nullptr, &errmsg)) {
+        cerr << "Error leaving WAL mode: " << errmsg << endl;
+        sqlite3_free(errmsg);
+    }
 
+    close_db();
+}
+
+void MBTilesWriter::close_db()
+{
+    sqlite3_finalize(insert_into_idmap);
+    sqlite3_finalize(insert_into_map);
+    sqlite3_finalize(insert_into_images);
+    insert_into_idmap = insert_into_map = insert_into_images = nullptr;
     sqlite3_close(db);
+    db = nullptr;
+}
+
+// The finalize steps can take long on big files, so they report their
+// progress on a line of their own.
+static void show_progress(const char *step, sqlite3_int64 done, sqlite3_int64 total)
+{
+    cout << "\r" << step << ": " << done << " of " << total;
+    if (total > 0)
+        cout << " (" << done * 100 / total << "%)";
+    cout << "\033[K" << std::flush;
+}
+
+// Gives the free pages (mostly idmap's) back to the file system a chunk at
+// a time, without moving the tiles.
+void MBTilesWriter::incremental_vacuum()
+{
+    if (query_int("PRAGMA auto_vacuum;") != 2) {
+        cout << "The database wasn't created with --finalize incremental, "
+                "its free pages are left for reuse." << endl;
+        return;
+    }
+
+    sqlite3_int64 total = query_int("PRAGMA freelist_count;");
+    sqlite3_int64 left = total;
+    while (left > 0) {
+        show_progress("Freeing pages", total - left, total);
+        char *errmsg;
+        if (sqlite3_exec(db, "PRAGMA incremental_vacuum(4096);", nullptr, nullptr, &errmsg)) {
+            cout << endl;
+            cerr << "Error freeing pages: " << errmsg << endl;
+            sqlite3_free(errmsg);
+            return;
+        }
+        sqlite3_int64 now = query_int("PRAGMA freelist_count;");
+        if (now >= left)
+            break;
+        left = now;
+    }
+    show_progress("Freeing pages", total - left, total);
+    cout << endl;
+}
+
+// Runs a single statement that can take long (VACUUM, INSERT ... SELECT).
+// There's no telling how far along it is, so the progress handler shows
+// the time it's been running instead.
+static int exec_timed(sqlite3 *db, const string& step, const char *sql, char **errmsg)
+{
+    struct timer {
+        const string& step;
+        std::chrono::steady_clock::time_point start;
+        long shown;
+    } t { step, std::chrono::steady_clock::now(), -1 };
+
+    sqlite3_progress_handler(db, 100000, [](void *p) {
+        timer *t = static_cast<timer *>(p);
+        long elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now() - t->start).count();
+        if (elapsed != t->shown) {
+            cout << "\r" << t->step << ": " << elapsed << "s\033[K" << std::flush;
+            t->shown = elapsed;
+        }
+        return 0;
+    }, &t);
+
+    int rc = sqlite3_exec(db, sql, nullptr, nullptr, errmsg);
+    sqlite3_progress_handler(db, 0, nullptr, nullptr);
+    if (t.shown >= 0)
+        cout << endl;
+    return rc;
+}
+
+void MBTilesWriter::vacuum()
+{
+    char *errmsg;
+    if (exec_timed(db, "Vacuuming", "VACUUM;", &errmsg) != SQLITE_OK) {
+        cerr << "Error vacuuming database: " << errmsg << endl;
+        sqlite3_free(errmsg);
+    }
+}
+
+// hilbert(zoom, col, row): position of a tile along the Hilbert curve of
+// its zoom level. Rows are stored as XYZ y (see exec_map), so this is the
+// same order PMTiles uses.
+static void hilbert_function(sqlite3_context *context, int, sqlite3_value **argv)
+{
+    int z = sqlite3_value_int(argv[0]);
+    sqlite3_int64 col = sqlite3_value_int64(argv[1]);
+    sqlite3_int64 row = sqlite3_value_int64(argv[2]);
+    sqlite3_result_int64(context, hilbert_index(z, col, row));
+}
+
+// Copies the tiles into FILE.rebuild, with images numbered and stored in
+// the order of their first tile: by (zoom, col, row) for rebuild, or by
+// (zoom, Hilbert index) for hilbert, so tiles that are read together sit
+// together. Images no tile uses are left out. Every step is a statement
+// that SQLite runs with its external merge sort, spilling to temporary
+// files, so files bigger than memory can be rebuilt. The new file
+// replaces this one only once it's complete.
+bool MBTilesWriter::rebuild()
+{
+    string target = file + ".rebuild";
+    boost::system::error_code ec;
+    fs::remove(target, ec);
+
+    sqlite3 *out;
+    if (sqlite3_open(target.c_str(), &out) != SQLITE_OK) {
+        cerr << "Error creating " << target << ": " << sqlite3_errmsg(out) << endl;
+        sqlite3_close(out);
+        return false;
+    }
+
+    auto fail = [&](const string& msg) {
+        cerr << endl << "Error rebuilding database, " << msg << ": " << sqlite3_errmsg(out) << endl;
+        sqlite3_close(out);
+        fs::remove(target, ec);
+        cerr << file << " is left as it was." << endl;
+        return false;
+    };
+
+    // the file is thrown away if anything goes wrong, so it needs no journal
+    string setup = "PRAGMA page_size = " + std::to_string(query_int("PRAGMA page_size;")) + ";"
+                   "PRAGMA journal_mode = OFF;"
+                   "PRAGMA synchronous = OFF;"
+                   "PRAGMA temp_store = FILE;"
+                   "PRAGMA cache_size = -262144;";
+    if (sqlite3_exec(out, setup.c_str(), nullptr, nullptr, nullptr))
+        return fail("setting it up");
+    if (sqlite3_create_function(out, "hilbert", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                nullptr, hilbert_function, nullptr, nullptr))
+        return fail("adding the hilbert function");
+    try {
+        create_tables(out, false);
+    } catch (const std::exception&) {
+        return fail("creating its tables");
+    }
+    if (!options.keep_idmap && sqlite3_exec(out, "DROP TABLE idmap;", nullptr, nullptr, nullptr))
+        return fail("dropping idmap");
+
+    char *attach = sqlite3_mprintf("ATTACH DATABASE %Q AS source;", file.c_str());
+    int rc = sqlite3_exec(out, attach, nullptr, nullptr, nullptr);
+    sqlite3_free(attach);
+    if (rc != SQLITE_OK)
+        return fail("attaching " + file);
+
+    if (sqlite3_exec(out, "BEGIN; INSERT INTO metadata SELECT * FROM source.metadata;",
+                     nullptr, nullptr, nullptr))
+        return fail("copying metadata");
+
+    const char *order = options.finalize == MBTilesOptions::Finalize::hilbert ?
+                        "zoom, hilbert(zoom, col, row)" : "zoom, col, row";
+    string order_tiles =
+        "CREATE TEMP TABLE tile_order (pos INTEGER PRIMARY KEY, zoom, col, row, tile_id);"
+        "INSERT INTO tile_order (zoom, col, row, tile_id) "
+        "  SELECT zoom, col, row, tile_id FROM source.map ORDER BY " + string(order) + ";";
+    struct step {
+        const char *name;
+        string sql;
+    };
+    std::vector<step> steps {
+        { "ordering tiles", order_tiles },
+        { "numbering images",
+          "CREATE TEMP TABLE image_order (pos INTEGER PRIMARY KEY, old_id INTEGER);"
+          "INSERT INTO image_order (old_id) "
+          "  SELECT tile_id FROM tile_order GROUP BY tile_id ORDER BY MIN(pos);"
+          "CREATE INDEX temp.image_order_old ON image_order (old_id);" },
+        { "copying images",
+          "INSERT INTO main.images "
+          "  SELECT o.pos - 1, i.tile_data FROM image_order o "
+          "  JOIN source.images i ON i.tile_id = o.old_id ORDER BY o.pos;" },
+        { "copying tiles",
+          "INSERT INTO main.map "
+          "  SELECT t.zoom, t.col, t.row, o.pos - 1 FROM tile_order t "
+          "  JOIN image_order o ON o.old_id = t.tile_id ORDER BY t.zoom, t.col, t.row;" },
+    };
+    if (options.keep_idmap) {
+        // the hashes follow their images to the new ids
+        steps.push_back({ "copying idmap",
+          "INSERT OR IGNORE INTO main.idmap "
+          "  SELECT m.md5, o.pos - 1 FROM source.idmap m "
+          "  JOIN image_order o ON o.old_id = m.tile_id;" });
+    }
+    for (const step& s: steps) {
+        string label = string("Rebuilding (") + s.name + ")";
+        if (exec_timed(out, label, s.sql.c_str(), nullptr) != SQLITE_OK)
+            return fail(s.name);
+    }
+
+    if (sqlite3_exec(out, "COMMIT; DETACH DATABASE source;", nullptr, nullptr, nullptr))
+        return fail("committing");
+    if (sqlite3_close(out) != SQLITE_OK)
+        return fail("closing it");
+
+    close_db();
+    fs::remove(file + "-wal", ec);
+    fs::remove(file + "-shm", ec);
+    fs::rename(target, file, ec);
+    if (ec)
+        cerr << "Error replacing " << file << ": " << ec.message()
+             << "; the rebuilt database is " << target << endl;
+    return true;
+}
+
+sqlite3_int64 MBTilesWriter::query_int(const char *sql)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        db_error(string("error preparing ") + sql);
+    sqlite3_int64 value = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+bool MBTilesWriter::idle()
+{
+    return insert_queue.empty();
+}
+
+int MBTilesWriter::queue_size() const
+{
+    return insert_queue.size();
+}
+
+size_t MBTilesWriter::queue_bytes() const
+{
+    return insert_queue.bytes();
+}
+
+MBTilesTileStore::MBTilesTileStore(const string &mbtiles_file, bool verbose,
+                                   const MBTilesOptions &options)
+    : mbtiles_file(mbtiles_file), verbose(verbose), options(options)
+{
+    int max_id = -1;
+    // when sharding, the MBTiles file is only read now and merged into
+    // when closing, so it needs no queue
+    size_t output_buffer = options.shards > 0 ? 0 : options.write_buffer;
+    output.reset(new MBTilesWriter(mbtiles_file, options, output_buffer, verbose));
+    // without --shards, the shards of an earlier sharded run are merged
+    // first: their tiles are rendered, and their image ids are taken
+    if (options.shards == 0)
+        merge_shards(*output, mbtiles_file, verbose);
+    output->load(idmap, max_id, rendered_tiles);
+
+    if (options.shards > 0) {
+        // the write buffer is split evenly between the shards
+        size_t shard_buffer = options.write_buffer / options.shards;
+        std::vector<string> files;
+        for (int i=0; i<options.shards; i++) {
+            files.push_back(mbtiles_file + ".shard" + std::to_string(i));
+            shards.emplace_back(new MBTilesWriter(files.back(), options, shard_buffer, verbose));
+            shards.back()->load(idmap, max_id, rendered_tiles);
+            writers.push_back(shards.back().get());
+        }
+        // a previous run may have used more shards; what they hold counts
+        // as rendered and is merged along with the rest
+        for (const string& f: find_shards(mbtiles_file)) {
+            if (std::find(files.begin(), files.end(), f) != files.end())
+                continue;
+            MBTilesWriter(f, options, 0, verbose).load(idmap, max_id, rendered_tiles);
+        }
+    } else {
+        writers.push_back(output.get());
+    }
+
+    next_tile_id = max_id + 1;
+    for (MBTilesWriter *w: writers)
+        w->start();
+}
+
+MBTilesTileStore::~MBTilesTileStore()
+{
+    close();
+}
+
+bool MBTilesTileStore::alreadyRendered(const tile &t)
+{
+    return rendered_tiles.contains(t);
+
+//    if (select_id_from_map == nullptr) {
+//        if (sqlite3_prepare_v2(db, "SELECT tile_id FROM map WHERE "
+//                               "zoom = ? AND col = ? AND row = ?;",
+//                               -1, &select_id_from_map, nullptr) != SQLITE_OK)
+//            db_error("error preparing select from map query");
+//    } else {
+//        if (sqlite3_reset(select_id_from_map) != SQLITE_OK)
+//            db_error("error resetting select from map query");
+//    }
+
+//    if (sqlite3_bind_int(select_id_from_map, 1, t.z) != SQLITE_OK)
+//        db_error("error binding insert into map query");
+//    if (sqlite3_bind_int(select_id_from_map, 2, t.x) != SQLITE_OK)
+//        db_error("error binding insert into map query");
+//    if (sqlite3_bind_int(select_id_from_map, 3, t.y) != SQLITE_OK)
+//        db_error("error binding insert into map query");
+
+//    int rc = sqlite3_step(select_id_from_map);
+//    if (!(rc == SQLITE_ROW || rc == SQLITE_DONE))
+//        db_error("error stepping through query");
+
+//    bool result = false;
+//    if (rc == SQLITE_ROW)
+//       result = true;
+
+//    return result;
+}
+
+void MBTilesTileStore::storeTile(const tile &t, string &&data, const rawhash &raw)
+{
+    md5digest digest = md5_digest(data);
+
+    IdMap::entry image;
+    if (idmap.find_or_add(digest, next_tile_id, image)) {
+        if (image.pending) {
+            lock_guard<mutex> guard { pending_mutex };
+            // look again now that it can't change: it may have been
+            // stored, or dropped, in the meantime
+            if (!idmap.find(digest, image)) {
+                storeTile(t, std::move(data), raw);
+                return;
+            }
+            if (image.pending) {
+                // The image is still being postprocessed, this tile will
+                // be queued right after it.
+                pending[digest].push_back(t);
+                return;
+            }
+        }
+        remember(raw, digest, image.id);
+        enqueue(t, "", image.id, "");
+        return;
+    }
+
+    _unique_tiles++;
+    int tile_id = image.id;
+    process(std::move(data), hexdigest(digest), [this, t, tile_id, digest, raw](string&& d) {
+        std::vector<tile> waiting;
+        {
+            lock_guard<mutex> guard { pending_mutex };
+            auto p = pending.find(digest);
+            if (p != pending.end()) {
+                waiting.swap(p->second);
+                pending.erase(p);
+            }
+            if (d.empty()) {
+                // forget it, so the next tile with this image tries again
+                idmap.erase(digest);
+                _unique_tiles--;
+                return;
+            }
+            idmap.set_ready(digest);
+        }
+        remember(raw, digest, tile_id);
+        enqueue(t, d, tile_id, string(reinterpret_cast<const char *>(&digest), sizeof(digest)));
+        for (const tile& w: waiting)
+            enqueue(w, "", tile_id, "");
+    });
+}
+
+bool MBTilesTileStore::storeExisting(const tile &t, const stored_image &image)
+{
+    // ids are never reused, so there's no need to look it up in idmap
+    enqueue(t, "", image.id, "");
+    return true;
+}
+
+// Images go to shards by id, and every tile goes to the shard of its
+// image: shards commit on their own, so a tile in another shard could be
+// committed, and count as rendered after a crash, while its image wasn't.
+MBTilesWriter &MBTilesTileStore::writer_for(int tile_id)
+{
+    return *writers[unsigned(tile_id) % writers.size()];
+}
+
+void MBTilesTileStore::enqueue(const tile &t, const string &data, int tile_id, const string &hash)
+{
+    // waits here while the queue is full, which slows rendering down to
+    // the writer's pace
+    double waited = writer_for(tile_id).push(t, tile_id, data, hash);
+    if (waited > 0)
+        stall_ns += uint64_t(waited * 1e9);
+}
+
+void MBTilesTileStore::close()
+{
+    if (!output)
+        return;
+
+    // images still being optimized are queued before the writers stop
+    if (_optimizer)
+        _optimizer->drain();
+
+    for (MBTilesWriter *w: writers)
+        w->stop();
+    writers.clear();
+
+    if (!shards.empty()) {
+        // close the shards, so their WAL is checkpointed before merging
+        shards.clear();
+        merge_shards(*output, mbtiles_file, verbose);
+    }
+
+    output->finalize();
+    output.reset();
 }
 
 bool MBTilesTileStore::finished()
 {
-    return _finished;
+    if (!TileStore::finished())
+        return false;
+    for (MBTilesWriter *w: writers)
+        if (!w->idle())
+            return false;
+    return true;
 }
 
 int MBTilesTileStore::queue_size() const
 {
-    return _queue_size;
+    int size = 0;
+    for (const MBTilesWriter *w: writers)
+        size += w->queue_size();
+    return size;
+}
+
+size_t MBTilesTileStore::queue_bytes() const
+{
+    size_t bytes = 0;
+    for (const MBTilesWriter *w: writers)
+        bytes += w->queue_bytes();
+    return bytes;
+}
+
+double MBTilesTileStore::stall_time() const
+{
+    return stall_ns.load() / 1e9;
+}
+
+bool MBTilesTileStore::write_queue(long &entries, size_t &bytes, double &stalled) const
+{
+    entries = queue_size();
+    bytes = queue_bytes();
+    stalled = stall_time();
+    return true;
 }
 
+// The shards of file.mbtiles are file.mbtiles.shard0, .shard1, ..., in
+// order. Merged shards are gone, so there may be gaps.
+std::vector<string> MBTilesTileStore::find_shards(const string &mbtiles_file)
+{
+    fs::path path(mbtiles_file);
+    fs::path dir = path.parent_path();
+    string prefix = path.filename().string() + ".shard";
+
+    std::vector<std::pair<long,string>> found;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(dir.empty() ? "." : dir, ec), end; !ec && it != end; it.increment(ec)) {
+        string name = it->path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0)
+            continue;
+        string number = name.substr(prefix.size());
+        if (number.empty() || number.find_first_not_of("0123456789") != string::npos)
+            continue;
+        found.push_back({std::stol(number), (dir / name).string()});
+    }
+    std::sort(found.begin(), found.end());
+
+    std::vector<string> files;
+    for (const auto& f: found)
+        files.push_back(f.second);
+    return files;
+}
+
+void MBTilesTileStore::merge_shards(MBTilesWriter &output, const string &mbtiles_file,
+                                    bool verbose)
+{
+    auto files = find_shards(mbtiles_file);
+    for (size_t i=0; i<files.size(); i++) {
+        if (verbose)
+            cout << "Merging " << files[i] << " (" << i + 1 << " of " << files.size() << ")." << endl;
+        output.merge(files[i]);
+        // a shard that's merged again (if this stops before removing it)
+        // changes nothing, so it's removed after its transaction commits
+        boost::system::error_code ec;
+        fs::remove(files[i] + "-wal", ec);
+        fs::remove(files[i] + "-shm", ec);
+        if (!fs::remove(files[i], ec) || ec)
+            cerr << "Error removing " << files[i] << ": " << ec.message() << endl;
+    }
+}
+
+void MBTilesTileStore::merge(const string &mbtiles_file, const MBTilesOptions &options,
+                             bool verbose)
+{
+    MBTilesWriter output(mbtiles_file, options, 0, verbose);
+    merge_shards(output, mbtiles_file, verbose);
+    output.finalize();
+}
@@ -18,80 +18,162 @@
 #define MBTILES_H
 
 
-#include <queue>
 #include <mutex>
 #include <thread>
 #include <atomic>
-#include <list>
+#include <memory>
+#include <vector>
 #include <unordered_map>
-#include <unordered_set>
 #include <condition_variable>
 
 #include <sqlite3.h>
 
 #include "tilestore.h"
-
-struct InsertOp {
-        InsertOp(const tile& t, std::string&& data, int id, const std::string& hash)
-            : t(t), data(std::move(data)), id(id), hash(hash)
-        {
-            //this->data.swap(data);
-        }
-//        ~InsertOp() {
-//            std::cout << "deleting op " << t << std::endl;
-//        }
-
-        const tile t;
-        const std::string data;
-        const int id;
-        const std::string hash;
+#include "tileindex.h"
+#include "idmap.h"
+#include "writequeue.h"
+
+struct MBTilesOptions {
+    // tune the database for bulk writes (WAL, bigger pages and cache)
+    bool bulk = false;
+    // create new databases without an index on map, and build it (once)
+    // when closing
+    bool defer_index = false;
+    // write operations per transaction
+    size_t batch_size = 10000;
+    // bytes of tiles waiting to be written; rendering waits when it's full
+    size_t write_buffer = size_t(1) << 30;
+    // write to this many shard databases in parallel, and merge them into
+    // the MBTiles file when closing; 0 writes to the file directly
+    int shards = 0;
+    // what's done to the file when closing:
+    //  none:        nothing but dropping idmap; its pages stay free
+    //  incremental: give free pages back (new files are created with
+    //               auto_vacuum=INCREMENTAL for this)
+    //  vacuum:      rewrite the file in place with VACUUM
+    //  rebuild:     copy tiles into a new file, ordered by zoom, column and
+    //               row, renumbering images in that order, and replace it
+    //  hilbert:     like rebuild, ordered by zoom and Hilbert index, so
+    //               the images of neighbouring tiles are stored together
+    enum class Finalize { none, incremental, vacuum, rebuild, hilbert };
+    Finalize finalize = Finalize::vacuum;
+    // keep the md5 -> image id table, so a later run deduplicates against
+    // the images already stored
+    bool keep_idmap = false;
 };
 
-class MBTilesTileStore : public TileStore {
+// One database, written by its own thread from its own queue. The store
+// has one for the MBTiles file, plus one per shard when sharding.
+class MBTilesWriter {
     public:
-        MBTilesTileStore(const std::string& mbtiles_file, bool verbose = false);
-        ~MBTilesTileStore();
-        bool alreadyRendered(const tile &t) override;
-        void storeTile(const tile &t, std::__cxx11::string &&data) override;
-        int unique_tiles() override { return _unique_tiles; }
-        void close() override;
-        bool finished() override;
+        MBTilesWriter(const std::string& file, const MBTilesOptions& options,
+                      size_t write_buffer, bool verbose);
+        ~MBTilesWriter();
+        // Adds the images and tiles in the database to idmap and rendered,
+        // and raises max_id to the largest image id found.
+        void load(IdMap& idmap, int& max_id,
+                  TileIndex& rendered);
+        void start();
+        // Queues a row for the writer; returns the seconds spent waiting
+        // for room in the queue.
+        double push(const tile& t, int tile_id, const std::string& data, const std::string& hash);
+        // Writes everything still queued and stops the writer.
+        void stop();
+        // Copies the tiles, images and ids of another database into this
+        // one, in a single transaction. Copying the same database twice
+        // changes nothing.
+        void merge(const std::string& file);
+        // Leaves a standard MBTiles file behind (indexed, out of WAL mode,
+        // compacted as options.finalize says) and closes it.
+        void finalize();
+        bool idle();
         int queue_size() const;
+        size_t queue_bytes() const;
 
     private:
-        void load_ids();
-        void load_rendered_tiles();
+        void load_ids(IdMap& idmap, int& max_id);
+        void load_rendered_tiles(TileIndex& rendered);
+        void load_rendered_tiles_scan(TileIndex& rendered);
+        bool map_indexed();
+        void build_index();
+        void incremental_vacuum();
+        void vacuum();
+        bool rebuild();
+        void close_db();
+        sqlite3_int64 query_int(const char *sql);
         void db_error(const std::string& msg);
         void write_loop();
+        void write_batch(std::vector<InsertOp>& batch);
         void exec(const InsertOp& op);
+        void exec_image(const InsertOp& op);
+        void exec_map(const InsertOp& op);
 
-        std::string mbtiles_file;
+        std::string file;
+        MBTilesOptions options;
         bool verbose;
-        bool _finished;
-        std::atomic_bool closing { false };
         sqlite3 *db;
-        std::unordered_map<std::string,int> idmap;
-        std::mutex idmap_mutex;
-
-        std::unordered_set<uint64_t> rendered_tiles;
-//        std::mutex rendered_tiles_mutex;
-
-        std::atomic_int _unique_tiles {0};
-        int next_tile_id;
-
-        std::queue<InsertOp, std::list<InsertOp>> insert_queue;
-        std::mutex insert_queue_mutex;
 
+        WriteQueue insert_queue;
+        std::atomic_bool closing { false };
         std::thread write_thread;
         std::condition_variable write_cond;
         std::mutex write_cond_m;
 
-        sqlite3_stmt *select_id_from_map = nullptr;
         sqlite3_stmt *insert_into_idmap = nullptr;
         sqlite3_stmt *insert_into_map = nullptr;
         sqlite3_stmt *insert_into_images = nullptr;
+};
+
+class MBTilesTileStore : public TileStore {
+    public:
+        MBTilesTileStore(const std::string& mbtiles_file, bool verbose = false,
+                         const MBTilesOptions& options = MBTilesOptions());
+        ~MBTilesTileStore();
+        bool alreadyRendered(const tile &t) override;
+        void storeTile(const tile &t, std::string &&data, const rawhash& raw) override;
+        int unique_tiles() override { return _unique_tiles; }
+        void close() override;
+        bool finished() override;
+        int queue_size() const;
+        size_t queue_bytes() const;
+        // total time spent waiting for room in the write queue, in seconds
+        double stall_time() const;
+        bool write_queue(long& entries, size_t& bytes, double& stalled) const override;
+
+        // Merges the shards left by a sharded run into the MBTiles file.
+        // Each shard is removed once it's merged, so an interrupted merge
+        // continues where it stopped.
+        static void merge(const std::string& mbtiles_file, const MBTilesOptions& options,
+                          bool verbose = false);
+
+    protected:
+        bool storeExisting(const tile& t, const stored_image& image) override;
+
+    private:
+        MBTilesWriter& writer_for(int tile_id);
+        void enqueue(const tile& t, const std::string& data, int tile_id, const std::string& hash);
+        static std::vector<std::string> find_shards(const std::string& mbtiles_file);
+        static void merge_shards(MBTilesWriter& output, const std::string& mbtiles_file,
+                                 bool verbose);
+
+        std::string mbtiles_file;
+        bool verbose;
+        MBTilesOptions options;
+        IdMap idmap;
+        // images being postprocessed, and the tiles waiting for them
+        std::unordered_map<md5digest,std::vector<tile>> pending;
+        std::mutex pending_mutex;
+
+        TileIndex rendered_tiles;
+
+        std::atomic_int _unique_tiles {0};
+        std::atomic_int next_tile_id { 0 };
 
-        size_t _queue_size = 0;
+        std::unique_ptr<MBTilesWriter> output;
+        std::vector<std::unique_ptr<MBTilesWriter>> shards;
+        // where rows are written: the output, or the shards
+        std::vector<MBTilesWriter*> writers;
+        std::atomic<uint64_t> stall_ns { 0 };
 };
 
 #endif // MBTILES_H
@@ -7,6 +7,8 @@
 from subprocess import check_output, STDOUT, CalledProcessError
 import os
 import sys
+import struct
+import tempfile
 
 def size(f):
     return os.stat(f).st_size
@@ -44,5 +46,53 @@ def optimize(f):
     os.rename(crush, f)
     os.remove(nq)
 
+def read_exactly(f, n):
+    data = b""
+    while len(data) < n:
+        chunk = f.read(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+def coprocess():
+    # Serves atrender -P: each request and each answer is a 4 byte
+    # big-endian length followed by that many bytes of PNG. An empty
+    # answer tells atrender the tile couldn't be optimized.
+    stdin = sys.stdin.buffer
+    stdout = sys.stdout.buffer
+    tmpdir = tempfile.mkdtemp()
+    f = os.path.join(tmpdir, "tile.png")
+    try:
+        while True:
+            header = read_exactly(stdin, 4)
+            if header is None:
+                break
+            (length,) = struct.unpack(">I", header)
+            data = read_exactly(stdin, length)
+            if data is None:
+                break
+            with open(f, "wb") as o:
+                o.write(data)
+            optimize(f)
+            result = b""
+            if os.path.exists(f):
+                with open(f, "rb") as i:
+                    result = i.read()
+            stdout.write(struct.pack(">I", len(result)) + result)
+            stdout.flush()
+    finally:
+        for name in os.listdir(tmpdir):
+            os.remove(os.path.join(tmpdir, name))
+        os.rmdir(tmpdir)
+
 if __name__ == "__main__":
-    optimize(sys.argv[1])
+    if len(sys.argv) != 2:
+        print("Usage: {} FILE.png | --coprocess".format(sys.argv[0]), file=sys.stderr)
+        print("  FILE.png     optimize FILE.png in place (for atrender -p)", file=sys.stderr)
+        print("  --coprocess  optimize tiles sent on stdin (for atrender -P)", file=sys.stderr)
+        sys.exit(2)
+    if sys.argv[1] == "--coprocess":
+        coprocess()
+    else:
+        optimize(sys.argv[1])
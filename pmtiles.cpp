@@ -0,0 +1,529 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
+#include <unistd.h>
+#include <zlib.h>
+#include <boost/filesystem.hpp>
+
+#include "pmtiles.h"
+#include "pngoptimizer.h"
+#include "hilbert.h"
+
+namespace fs = boost::filesystem;
+
+using std::string;
+using std::mutex;
+using std::lock_guard;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static const int header_size = 127;
+// The header and the root directory must fit in the first 16K of the
+// file; tile data is written right after them.
+static const uint64_t data_offset = 16384;
+static const char journal_magic[8] = { 'P','M','T','J','R','N','L','1' };
+// journal records: 'i', image id, offset, length, md5 (33 bytes) and
+// 't', z, x, y, image id (14 bytes); numbers are little endian
+static const int image_record = 33;
+static const int tile_record = 14;
+
+static void put(char *p, uint64_t v, int bytes)
+{
+    for (int i=0; i<bytes; i++)
+        p[i] = char(v >> (8 * i));
+}
+
+static void put(string& s, uint64_t v, int bytes)
+{
+    char b[8];
+    put(b, v, bytes);
+    s.append(b, bytes);
+}
+
+static uint64_t get(const char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i=0; i<bytes; i++)
+        v |= uint64_t(uint8_t(p[i])) << (8 * i);
+    return v;
+}
+
+static void put_varint(string& s, uint64_t v)
+{
+    while (v >= 0x80) {
+        s += char(v | 0x80);
+        v >>= 7;
+    }
+    s += char(v);
+}
+
+static string gzip(const string& data)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("Error initializing zlib");
+    string out(deflateBound(&z, data.size()), '\0');
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = data.size();
+    z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    z.avail_out = out.size();
+    int rc = deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END)
+        throw std::runtime_error("Error compressing PMTiles directory");
+    return out;
+}
+
+// PMTiles numbers tiles zoom level after zoom level, each along a Hilbert
+// curve
+static uint64_t tile_id(const tile& t)
+{
+    uint64_t before = ((uint64_t(1) << (2 * t.z)) - 1) / 3;
+    return before + hilbert_index(t.z, t.x, t.y);
+}
+
+static double x2lon(double x)
+{
+    return x * 360.0 - 180.0;
+}
+
+static double y2lat(double y)
+{
+    return atan(sinh(M_PI * (1 - 2 * y))) * 180.0 / M_PI;
+}
+
+PMTilesTileStore::PMTilesTileStore(const string &pmtiles_file, bool verbose)
+    : pmtiles_file(pmtiles_file), journal_file(pmtiles_file + ".journal"),
+      verbose(verbose)
+{
+    if (!fs::exists(pmtiles_file))
+        create();
+    else if (fs::exists(journal_file))
+        resume();
+    else
+        throw std::runtime_error(pmtiles_file + " is complete (there's no " + journal_file +
+                                 " to resume from); remove it to render it again");
+    setvbuf(data, nullptr, _IOFBF, 1 << 20);
+}
+
+PMTilesTileStore::~PMTilesTileStore()
+{
+    close();
+}
+
+void PMTilesTileStore::create()
+{
+    data = fopen(pmtiles_file.c_str(), "w+b");
+    if (!data)
+        throw std::runtime_error("Error creating " + pmtiles_file + ": " + strerror(errno));
+    // room for the header and root directory, written when closing
+    string head(data_offset, '\0');
+    fwrite(head.data(), 1, head.size(), data);
+
+    journal = fopen(journal_file.c_str(), "wb");
+    if (!journal)
+        throw std::runtime_error("Error creating " + journal_file + ": " + strerror(errno));
+    fwrite(journal_magic, 1, sizeof(journal_magic), journal);
+}
+
+// Reads the journal back. Records are written after the data they refer
+// to, but the journal and the file may have been flushed at different
+// times, so everything from the first record pointing past the data on
+// disk is dropped, and both files are cut where the good part ends.
+void PMTilesTileStore::resume()
+{
+    if (verbose) cout << "Loading rendered tiles from " << journal_file << "... ";
+
+    uint64_t size = fs::file_size(pmtiles_file);
+    uint64_t available = size > data_offset ? size - data_offset : 0;
+
+    std::ifstream in(journal_file, std::ios::binary);
+    char r[image_record];
+    if (!in.read(r, sizeof(journal_magic)) || memcmp(r, journal_magic, sizeof(journal_magic)) != 0)
+        throw std::runtime_error(journal_file + " isn't a PMTiles journal");
+    uint64_t good = sizeof(journal_magic);
+    int max_id = -1;
+    while (in.get(r[0])) {
+        if (r[0] == 'i') {
+            if (!in.read(r + 1, image_record - 1))
+                break;
+            int id = get(r + 1, 4);
+            image img { get(r + 5, 8), uint32_t(get(r + 13, 4)) };
+            if (id < 0 || img.length == 0 || img.offset + img.length > available)
+                break;
+            md5digest digest;
+            memcpy(&digest, r + 17, sizeof(digest));
+            if (size_t(id) >= images.size())
+                images.resize(id + 1, image { 0, 0 });
+            images[id] = img;
+            idmap.insert(digest, id);
+            data_length = std::max(data_length, img.offset + img.length);
+            max_id = std::max(max_id, id);
+            good += image_record;
+        } else if (r[0] == 't') {
+            if (!in.read(r + 1, tile_record - 1))
+                break;
+            tile t { int(get(r + 2, 4)), int(get(r + 6, 4)), uint8_t(r[1]) };
+            int id = get(r + 10, 4);
+            if (t.z > 31 || id < 0 || size_t(id) >= images.size() || images[id].length == 0)
+                break;
+            tiles.push_back(stored_tile { tile_id(t), id });
+            rendered_tiles.insert(t);
+            extend(t);
+            good += tile_record;
+        } else {
+            break;
+        }
+    }
+    in.close();
+    next_image_id = max_id + 1;
+
+    if (truncate(journal_file.c_str(), good) != 0 ||
+            truncate(pmtiles_file.c_str(), data_offset + data_length) != 0)
+        throw std::runtime_error("Error truncating " + pmtiles_file + ": " + strerror(errno));
+
+    data = fopen(pmtiles_file.c_str(), "r+b");
+    if (!data)
+        throw std::runtime_error("Error opening " + pmtiles_file + ": " + strerror(errno));
+    fseeko(data, 0, SEEK_END);
+    journal = fopen(journal_file.c_str(), "ab");
+    if (!journal)
+        throw std::runtime_error("Error opening " + journal_file + ": " + strerror(errno));
+
+    if (verbose) cout << "done (" << rendered_tiles.size() << " tiles)." << endl;
+}
+
+bool PMTilesTileStore::alreadyRendered(const tile &t)
+{
+    return rendered_tiles.contains(t);
+}
+
+void PMTilesTileStore::storeTile(const tile &t, string &&data, const rawhash &raw)
+{
+    md5digest digest = md5_digest(data);
+
+    IdMap::entry image;
+    if (idmap.find_or_add(digest, next_image_id, image)) {
+        if (image.pending) {
+            lock_guard<mutex> guard { pending_mutex };
+            // look again now that it can't change: it may have been
+            // stored, or dropped, in the meantime
+            if (!idmap.find(digest, image)) {
+                storeTile(t, std::move(data), raw);
+                return;
+            }
+            if (image.pending) {
+                // The image is still being postprocessed, this tile will
+                // be added right after it.
+                pending[digest].push_back(t);
+                return;
+            }
+        }
+        remember(raw, digest, image.id);
+        add_tile(t, image.id);
+        return;
+    }
+
+    _unique_tiles++;
+    int id = image.id;
+    process(std::move(data), hexdigest(digest), [this, t, id, digest, raw](string&& d) {
+        // the image goes into the journal before any tile using it; one
+        // that couldn't be written is dropped like one that failed to
+        // process, and its tiles are left for the next run
+        bool stored = !d.empty() && add_image(id, digest, d);
+        std::vector<tile> waiting;
+        {
+            lock_guard<mutex> guard { pending_mutex };
+            auto p = pending.find(digest);
+            if (p != pending.end()) {
+                waiting.swap(p->second);
+                pending.erase(p);
+            }
+            if (!stored) {
+                // forget it, so the next tile with this image tries again
+                idmap.erase(digest);
+                _unique_tiles--;
+                return;
+            }
+            idmap.set_ready(digest);
+        }
+        remember(raw, digest, id);
+        add_tile(t, id);
+        for (const tile& w: waiting)
+            add_tile(w, id);
+    });
+}
+
+bool PMTilesTileStore::storeExisting(const tile &t, const stored_image &image)
+{
+    add_tile(t, image.id);
+    return true;
+}
+
+bool PMTilesTileStore::add_image(int id, const md5digest &digest, const string &d)
+{
+    lock_guard<mutex> guard { file_mutex };
+    image img { data_length, uint32_t(d.size()) };
+    if (fwrite(d.data(), 1, d.size(), data) != d.size()) {
+        perror(("Error writing to " + pmtiles_file).c_str());
+        // the next image goes where this one should have been
+        clearerr(data);
+        fseeko(data, data_offset + data_length, SEEK_SET);
+        return false;
+    }
+    data_length += d.size();
+    if (size_t(id) >= images.size())
+        images.resize(id + 1, image { 0, 0 });
+    images[id] = img;
+
+    char r[image_record];
+    r[0] = 'i';
+    put(r + 1, id, 4);
+    put(r + 5, img.offset, 8);
+    put(r + 13, img.length, 4);
+    memcpy(r + 17, &digest, sizeof(digest));
+    journal_write(r, sizeof(r));
+    return true;
+}
+
+void PMTilesTileStore::add_tile(const tile &t, int id)
+{
+    uint64_t tid = tile_id(t);
+    char r[tile_record];
+    r[0] = 't';
+    r[1] = char(t.z);
+    put(r + 2, t.x, 4);
+    put(r + 6, t.y, 4);
+    put(r + 10, id, 4);
+
+    lock_guard<mutex> guard { file_mutex };
+    tiles.push_back(stored_tile { tid, id });
+    extend(t);
+    journal_write(r, sizeof(r));
+}
+
+void PMTilesTileStore::extend(const tile &t)
+{
+    double n = double(uint64_t(1) << t.z);
+    minzoom = std::min(minzoom, t.z);
+    maxzoom = std::max(maxzoom, t.z);
+    minx = std::min(minx, t.x / n);
+    miny = std::min(miny, t.y / n);
+    maxx = std::max(maxx, (t.x + 1) / n);
+    maxy = std::max(maxy, (t.y + 1) / n);
+}
+
+void PMTilesTileStore::journal_write(const char *record, size_t size)
+{
+    if (fwrite(record, 1, size, journal) != size)
+        perror(("Error writing to " + journal_file).c_str());
+}
+
+void PMTilesTileStore::close()
+{
+    if (!data)
+        return;
+
+    // images still being optimized are stored before the directories
+    // are written
+    if (_optimizer)
+        _optimizer->drain();
+
+    lock_guard<mutex> guard { file_mutex };
+    finalize();
+}
+
+// Sorts the tiles by id and turns them into directory entries, one per
+// run of consecutive tiles with the same image.
+std::vector<PMTilesTileStore::entry> PMTilesTileStore::tile_entries()
+{
+    std::sort(tiles.begin(), tiles.end(), [](const stored_tile& a, const stored_tile& b) {
+        return a.tile_id < b.tile_id;
+    });
+
+    std::vector<entry> entries;
+    for (const stored_tile& t: tiles) {
+        const image& img = images[t.image];
+        if (!entries.empty()) {
+            entry& last = entries.back();
+            // a tile stored twice keeps its first image
+            if (t.tile_id < last.tile_id + last.run_length)
+                continue;
+            if (t.tile_id == last.tile_id + last.run_length && img.offset == last.offset) {
+                last.run_length++;
+                continue;
+            }
+        }
+        entries.push_back(entry { t.tile_id, img.offset, img.length, 1 });
+    }
+    std::vector<stored_tile>().swap(tiles);
+    return entries;
+}
+
+void PMTilesTileStore::finalize()
+{
+    if (verbose) cout << "Writing PMTiles directories... " << std::flush;
+
+    std::vector<entry> entries = tile_entries();
+    string root, leaves;
+    build_directories(entries, root, leaves);
+    string meta = metadata();
+
+    uint64_t metadata_offset = data_offset + data_length;
+    uint64_t leaves_offset = metadata_offset + meta.size();
+    string head = header(root, metadata_offset, meta.size(), leaves_offset, leaves.size(), entries);
+    bool ok = fseeko(data, metadata_offset, SEEK_SET) == 0 &&
+              fwrite(meta.data(), 1, meta.size(), data) == meta.size() &&
+              fwrite(leaves.data(), 1, leaves.size(), data) == leaves.size() &&
+              fseeko(data, 0, SEEK_SET) == 0 &&
+              fwrite(head.data(), 1, head.size(), data) == head.size() &&
+              fwrite(root.data(), 1, root.size(), data) == root.size() &&
+              fflush(data) == 0 && fsync(fileno(data)) == 0;
+    ok = fclose(data) == 0 && ok;
+    data = nullptr;
+    fclose(journal);
+    journal = nullptr;
+
+    if (!ok) {
+        // the journal stays, a new run finishes the file
+        cerr << "Error writing " << pmtiles_file << ": " << strerror(errno) << endl;
+        return;
+    }
+    fs::remove(journal_file);
+
+    if (verbose) cout << "done (" << entries.size() << " entries)." << endl;
+}
+
+string PMTilesTileStore::serialize(std::vector<entry>::const_iterator begin,
+                                   std::vector<entry>::const_iterator end)
+{
+    string s;
+    put_varint(s, end - begin);
+    uint64_t last_id = 0;
+    for (auto e = begin; e != end; ++e) {
+        put_varint(s, e->tile_id - last_id);
+        last_id = e->tile_id;
+    }
+    for (auto e = begin; e != end; ++e)
+        put_varint(s, e->run_length);
+    for (auto e = begin; e != end; ++e)
+        put_varint(s, e->length);
+    for (auto e = begin; e != end; ++e) {
+        // 0 means right after the previous entry
+        auto prev = e - 1;
+        if (e != begin && e->offset == prev->offset + prev->length)
+            put_varint(s, 0);
+        else
+            put_varint(s, e->offset + 1);
+    }
+    return gzip(s);
+}
+
+// Puts every entry in the root directory if it fits in the 16K at the
+// start of the file. Otherwise the entries are split in leaf directories
+// and the root points to them, with leaves made bigger until it fits.
+void PMTilesTileStore::build_directories(const std::vector<entry> &entries,
+                                         string &root, string &leaves)
+{
+    const size_t max_root = data_offset - header_size;
+    root = serialize(entries.begin(), entries.end());
+    leaves.clear();
+    if (root.size() <= max_root)
+        return;
+
+    size_t leaf_size = std::max(size_t(4096), entries.size() / 3500);
+    while (true) {
+        std::vector<entry> root_entries;
+        leaves.clear();
+        for (size_t i = 0; i < entries.size(); i += leaf_size) {
+            auto end = entries.begin() + std::min(entries.size(), i + leaf_size);
+            string leaf = serialize(entries.begin() + i, end);
+            // run length 0 marks a leaf directory
+            root_entries.push_back(entry { entries[i].tile_id, leaves.size(), uint32_t(leaf.size()), 0 });
+            leaves += leaf;
+        }
+        root = serialize(root_entries.begin(), root_entries.end());
+        if (root.size() <= max_root)
+            return;
+        leaf_size += leaf_size / 5;
+    }
+}
+
+string PMTilesTileStore::metadata()
+{
+    string name;
+    for (char c: fs::path(pmtiles_file).stem().string()) {
+        if (c == '"' || c == '\\')
+            name += '\\';
+        if (uint8_t(c) >= 0x20)
+            name += c;
+    }
+    return gzip("{\"name\":\"" + name + "\",\"format\":\"png\",\"type\":\"baselayer\"}");
+}
+
+string PMTilesTileStore::header(const string &root, uint64_t metadata_offset,
+                                uint64_t metadata_length, uint64_t leaves_offset,
+                                uint64_t leaves_length, const std::vector<entry> &entries)
+{
+    uint64_t addressed = 0;
+    std::unordered_set<uint64_t> contents;
+    for (const entry& e: entries) {
+        addressed += e.run_length;
+        contents.insert(e.offset);
+    }
+    if (entries.empty()) {
+        minzoom = maxzoom = 0;
+        minx = miny = 0;
+        maxx = maxy = 1;
+    }
+    auto e7 = [](double deg) { return uint32_t(int32_t(lround(deg * 1e7))); };
+
+    string h("PMTiles\x03", 8);
+    put(h, header_size, 8);
+    put(h, root.size(), 8);
+    put(h, metadata_offset, 8);
+    put(h, metadata_length, 8);
+    put(h, leaves_offset, 8);
+    put(h, leaves_length, 8);
+    put(h, data_offset, 8);
+    put(h, data_length, 8);
+    put(h, addressed, 8);
+    put(h, entries.size(), 8);
+    put(h, contents.size(), 8);
+    put(h, 0, 1);  // not clustered: data is in the order it was rendered
+    put(h, 2, 1);  // directories and metadata are gzipped
+    put(h, 1, 1);  // tiles aren't compressed
+    put(h, 2, 1);  // PNG
+    put(h, minzoom, 1);
+    put(h, maxzoom, 1);
+    put(h, e7(x2lon(minx)), 4);
+    put(h, e7(y2lat(maxy)), 4);
+    put(h, e7(x2lon(maxx)), 4);
+    put(h, e7(y2lat(miny)), 4);
+    put(h, minzoom, 1);
+    put(h, e7(x2lon((minx + maxx) / 2)), 4);
+    put(h, e7(y2lat((miny + maxy) / 2)), 4);
+    return h;
+}
@@ -0,0 +1,117 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PMTILES_H
+#define PMTILES_H
+
+#include <cstdio>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+
+#include "tilestore.h"
+#include "tileindex.h"
+#include "idmap.h"
+
+/* Saves tiles as a PMTiles (version 3) archive: a single file that can be
+ * served with HTTP range requests.
+ *
+ * Image data is appended to the file as it's rendered, each distinct image
+ * once, after room left for the header and the root directory. Every
+ * image and tile written is also recorded in a journal, FILE.journal, so
+ * an interrupted run resumes from it. When closing, tiles are sorted by
+ * their PMTiles id (their position along a Hilbert curve), runs of
+ * consecutive tiles with the same image become a single entry, and the
+ * directories and header are written; the journal is then removed.
+ */
+class PMTilesTileStore : public TileStore {
+    public:
+        PMTilesTileStore(const std::string& pmtiles_file, bool verbose = false);
+        ~PMTilesTileStore();
+        bool alreadyRendered(const tile &t) override;
+        void storeTile(const tile &t, std::string &&data, const rawhash& raw) override;
+        int unique_tiles() override { return _unique_tiles; }
+        void close() override;
+
+    protected:
+        bool storeExisting(const tile& t, const stored_image& image) override;
+
+    private:
+        // an image's place in the tile data section
+        struct image {
+            uint64_t offset;
+            uint32_t length;
+        };
+        struct stored_tile {
+            uint64_t tile_id;
+            int image;
+        };
+        struct entry {
+            uint64_t tile_id;
+            uint64_t offset;
+            uint32_t length;
+            uint32_t run_length;
+        };
+
+        void create();
+        void resume();
+        // Appends an image to the data section. Returns false, leaving
+        // the file as it was, if it couldn't be written.
+        bool add_image(int id, const md5digest& digest, const std::string& data);
+        void add_tile(const tile& t, int id);
+        void extend(const tile& t);
+        void journal_write(const char *record, size_t size);
+        void finalize();
+        std::vector<entry> tile_entries();
+        std::string metadata();
+        static std::string serialize(std::vector<entry>::const_iterator begin,
+                                     std::vector<entry>::const_iterator end);
+        void build_directories(const std::vector<entry>& entries,
+                               std::string& root, std::string& leaves);
+        std::string header(const std::string& root, uint64_t metadata_offset,
+                           uint64_t metadata_length, uint64_t leaves_offset,
+                           uint64_t leaves_length, const std::vector<entry>& entries);
+
+        std::string pmtiles_file;
+        std::string journal_file;
+        bool verbose;
+        IdMap idmap;
+        // images being postprocessed, and the tiles waiting for them
+        std::unordered_map<md5digest,std::vector<tile>> pending;
+        std::mutex pending_mutex;
+
+        TileIndex rendered_tiles;
+
+        std::atomic_int _unique_tiles {0};
+        std::atomic_int next_image_id { 0 };
+
+        // guards everything below
+        std::mutex file_mutex;
+        FILE *data = nullptr;
+        FILE *journal = nullptr;
+        // bytes of tile data written
+        uint64_t data_length = 0;
+        // indexed by image id; ids of images that failed are never used
+        std::vector<image> images;
+        std::vector<stored_tile> tiles;
+        // zoom levels and extent (in fractions of the world, y down) of
+        // the tiles stored
+        int minzoom = 32, maxzoom = -1;
+        double minx = 1, miny = 1, maxx = 0, maxy = 0;
+};
+
+#endif // PMTILES_H
@@ -0,0 +1,389 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include <png.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "pngoptimizer.h"
+
+using std::string;
+using std::vector;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+PngOptimizer::PngOptimizer(int threads)
+    : max_jobs(4 * std::max(1, threads))
+{
+    for (int i=0; i<std::max(1, threads); i++)
+        this->threads.emplace_back([this]() { work(); });
+}
+
+PngOptimizer::~PngOptimizer()
+{
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        stopping = true;
+    }
+    jobs_cond.notify_all();
+    for (auto& t: threads)
+        t.join();
+}
+
+void PngOptimizer::submit(string &&png, callback done)
+{
+    {
+        unique_lock<mutex> lock(jobs_mutex);
+        room_cond.wait(lock, [this]() { return jobs.size() < max_jobs; });
+        jobs.push({ std::move(png), done });
+    }
+    jobs_cond.notify_one();
+}
+
+bool PngOptimizer::idle()
+{
+    lock_guard<mutex> lock(jobs_mutex);
+    return jobs.empty() && active == 0;
+}
+
+void PngOptimizer::drain()
+{
+    unique_lock<mutex> lock(jobs_mutex);
+    idle_cond.wait(lock, [this]() { return jobs.empty() && active == 0; });
+}
+
+void PngOptimizer::work()
+{
+    unique_lock<mutex> lock(jobs_mutex);
+    while (true) {
+        jobs_cond.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        // pending jobs are finished before stopping
+        if (jobs.empty())
+            break;
+        job j = std::move(jobs.front());
+        jobs.pop();
+        active++;
+        lock.unlock();
+        room_cond.notify_one();
+
+        j.done(optimize(j.png));
+
+        lock.lock();
+        active--;
+        if (jobs.empty() && active == 0)
+            idle_cond.notify_all();
+    }
+}
+
+// libpng reports errors with longjmp, so the functions calling it only
+// keep plain data (or objects created before setjmp) on their frames.
+
+struct read_state {
+    const string *data;
+    size_t pos;
+};
+
+static void read_from_string(png_structp png, png_bytep out, png_size_t length)
+{
+    read_state *s = static_cast<read_state *>(png_get_io_ptr(png));
+    if (s->pos + length > s->data->size())
+        png_error(png, "read past the end of the image");
+    memcpy(out, s->data->data() + s->pos, length);
+    s->pos += length;
+}
+
+static void write_to_string(png_structp png, png_bytep data, png_size_t length)
+{
+    string *s = static_cast<string *>(png_get_io_ptr(png));
+    s->append(reinterpret_cast<const char *>(data), length);
+}
+
+static void flush_nothing(png_structp)
+{
+}
+
+// Decodes any PNG into 8 bit RGBA pixels.
+static bool decode(const string& data, vector<uint8_t>& rgba, unsigned& width, unsigned& height)
+{
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png)
+        return false;
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return false;
+    }
+    vector<png_bytep> rows;
+    read_state state { &data, 0 };
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+
+    png_set_read_fn(png, &state, read_from_string);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    width = png_get_image_width(png, info);
+    height = png_get_image_height(png, info);
+    rgba.resize(size_t(width) * height * 4);
+    rows.resize(height);
+    for (unsigned y=0; y<height; y++)
+        rows[y] = &rgba[size_t(y) * width * 4];
+    png_read_image(png, rows.data());
+    png_read_end(png, nullptr);
+    png_destroy_read_struct(&png, &info, nullptr);
+    return true;
+}
+
+static uint32_t pack(const uint8_t *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static int channel(uint32_t c, int i)
+{
+    return (c >> (8 * i)) & 0xff;
+}
+
+struct color_count {
+    uint32_t color;
+    uint32_t count;
+};
+
+// Median cut over the image's colors, alpha included: keeps splitting the
+// box with the widest channel at its population median.
+static vector<uint32_t> median_cut(vector<color_count>& colors, size_t max)
+{
+    struct box { size_t begin, end; int channel; int range; };
+    auto measure = [&colors](box& b) {
+        b.range = -1;
+        for (int c=0; c<4; c++) {
+            int lo = 255, hi = 0;
+            for (size_t i=b.begin; i<b.end; i++) {
+                lo = std::min(lo, channel(colors[i].color, c));
+                hi = std::max(hi, channel(colors[i].color, c));
+            }
+            if (hi - lo > b.range) {
+                b.range = hi - lo;
+                b.channel = c;
+            }
+        }
+    };
+
+    vector<box> boxes;
+    boxes.push_back({ 0, colors.size(), 0, 0 });
+    measure(boxes[0]);
+    while (boxes.size() < max) {
+        auto widest = std::max_element(boxes.begin(), boxes.end(), [](const box& a, const box& b) {
+            return a.range < b.range;
+        });
+        if (widest->range <= 0)
+            break;
+        box b = *widest;
+        int c = b.channel;
+        std::sort(colors.begin() + b.begin, colors.begin() + b.end, [c](const color_count& x, const color_count& y) {
+            return channel(x.color, c) < channel(y.color, c);
+        });
+        uint64_t population = 0;
+        for (size_t i=b.begin; i<b.end; i++)
+            population += colors[i].count;
+        uint64_t half = 0;
+        size_t split = b.begin;
+        while (split < b.end - 1 && half + colors[split].count <= population / 2)
+            half += colors[split++].count;
+        if (split == b.begin)
+            split++;
+
+        box left { b.begin, split, 0, 0 };
+        box right { split, b.end, 0, 0 };
+        measure(left);
+        measure(right);
+        *widest = left;
+        boxes.push_back(right);
+    }
+
+    vector<uint32_t> palette;
+    for (const box& b: boxes) {
+        uint64_t sum[4] = { 0, 0, 0, 0 };
+        uint64_t n = 0;
+        for (size_t i=b.begin; i<b.end; i++) {
+            for (int c=0; c<4; c++)
+                sum[c] += uint64_t(channel(colors[i].color, c)) * colors[i].count;
+            n += colors[i].count;
+        }
+        uint32_t color = 0;
+        for (int c=0; c<4; c++)
+            color |= uint32_t((sum[c] + n / 2) / n) << (8 * c);
+        palette.push_back(color);
+    }
+    return palette;
+}
+
+static size_t nearest(const vector<uint32_t>& palette, uint32_t color)
+{
+    size_t best = 0;
+    int best_distance = 0x7fffffff;
+    for (size_t i=0; i<palette.size(); i++) {
+        int d = 0;
+        for (int c=0; c<4; c++) {
+            int delta = channel(palette[i], c) - channel(color, c);
+            d += delta * delta;
+        }
+        if (d < best_distance) {
+            best_distance = d;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Writes a palette image with the given settings; indices holds one byte
+// per pixel, and is packed here to bit_depth.
+static bool encode(const vector<uint8_t>& indices, unsigned width, unsigned height,
+                   const vector<uint32_t>& palette, int bit_depth,
+                   int filters, int strategy, string& out)
+{
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png)
+        return false;
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, nullptr);
+        return false;
+    }
+
+    size_t stride = (size_t(width) * bit_depth + 7) / 8;
+    vector<uint8_t> packed(stride * height, 0);
+    int per_byte = 8 / bit_depth;
+    for (unsigned y=0; y<height; y++) {
+        for (unsigned x=0; x<width; x++) {
+            uint8_t v = indices[size_t(y) * width + x];
+            int shift = 8 - bit_depth * (x % per_byte + 1);
+            packed[y * stride + x / per_byte] |= v << shift;
+        }
+    }
+    vector<png_color> plte(palette.size());
+    vector<png_byte> trns;
+    for (size_t i=0; i<palette.size(); i++) {
+        plte[i].red = channel(palette[i], 0);
+        plte[i].green = channel(palette[i], 1);
+        plte[i].blue = channel(palette[i], 2);
+        // translucent entries come first, so tRNS stops at the last of them
+        if (channel(palette[i], 3) != 255)
+            trns.resize(i + 1, 255);
+        if (i < trns.size())
+            trns[i] = channel(palette[i], 3);
+    }
+    vector<png_bytep> rows(height);
+    for (unsigned y=0; y<height; y++)
+        rows[y] = &packed[y * stride];
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    png_set_write_fn(png, &out, write_to_string, flush_nothing);
+    png_set_IHDR(png, info, width, height, bit_depth, PNG_COLOR_TYPE_PALETTE,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(png, info, plte.data(), plte.size());
+    if (!trns.empty())
+        png_set_tRNS(png, info, trns.data(), trns.size(), nullptr);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, filters);
+    png_set_compression_level(png, Z_BEST_COMPRESSION);
+    png_set_compression_mem_level(png, 9);
+    png_set_compression_strategy(png, strategy);
+    png_set_rows(png, info, rows.data());
+    png_write_png(png, info, PNG_TRANSFORM_IDENTITY, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+string PngOptimizer::optimize(const string &png)
+{
+    vector<uint8_t> rgba;
+    unsigned width, height;
+    if (!decode(png, rgba, width, height) || width == 0 || height == 0)
+        return png;
+
+    std::unordered_map<uint32_t, uint32_t> histogram;
+    size_t pixels = size_t(width) * height;
+    for (size_t i=0; i<pixels; i++) {
+        uint32_t c = pack(&rgba[i * 4]);
+        // fully transparent pixels are all the same
+        if ((c >> 24) == 0)
+            c = 0;
+        histogram[c]++;
+    }
+
+    vector<color_count> colors;
+    for (const auto& h: histogram)
+        colors.push_back({ h.first, h.second });
+
+    vector<uint32_t> palette;
+    if (colors.size() <= 256) {
+        for (const color_count& c: colors)
+            palette.push_back(c.color);
+    } else {
+        palette = median_cut(colors, 256);
+    }
+    std::stable_sort(palette.begin(), palette.end(), [](uint32_t a, uint32_t b) {
+        return (channel(a, 3) != 255) > (channel(b, 3) != 255);
+    });
+
+    std::unordered_map<uint32_t, uint8_t> index;
+    for (const auto& h: histogram)
+        index[h.first] = nearest(palette, h.first);
+
+    vector<uint8_t> indices(pixels);
+    for (size_t i=0; i<pixels; i++) {
+        uint32_t c = pack(&rgba[i * 4]);
+        if ((c >> 24) == 0)
+            c = 0;
+        indices[i] = index[c];
+    }
+
+    int bit_depth = 8;
+    if (palette.size() <= 2) bit_depth = 1;
+    else if (palette.size() <= 4) bit_depth = 2;
+    else if (palette.size() <= 16) bit_depth = 4;
+
+    string best = png;
+    const int filters[] = { PNG_FILTER_NONE, PNG_ALL_FILTERS };
+    const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+    for (int f: filters) {
+        for (int s: strategies) {
+            string out;
+            out.reserve(best.size());
+            if (encode(indices, width, height, palette, bit_depth, f, s, out) &&
+                    out.size() < best.size())
+                best.swap(out);
+        }
+    }
+    return best;
+}
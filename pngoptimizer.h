@@ -0,0 +1,73 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PNGOPTIMIZER_H
+#define PNGOPTIMIZER_H
+
+#include <queue>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/* In-process replacement for optimize_png.py: reduces the image to a
+ * palette (exactly when it has at most 256 colors, by median cut
+ * otherwise), picks the smallest bit depth that fits, and tries several
+ * filter and zlib strategy combinations, keeping the smallest result.
+ *
+ * Images are optimized on a pool of dedicated threads; the render
+ * threads hand them over with submit() and carry on, unless a few images
+ * per pool thread are already waiting.
+ */
+class PngOptimizer {
+    public:
+        typedef std::function<void(std::string&&)> callback;
+
+        PngOptimizer(int threads);
+        ~PngOptimizer();
+        // Optimizes png on one of the pool threads and calls done with
+        // the result (also on that thread). Waits while the queue is full.
+        void submit(std::string&& png, callback done);
+        // True when there are no images queued or being optimized.
+        bool idle();
+        // Blocks until idle.
+        void drain();
+
+        // Returns the optimized image, or png itself if it can't be
+        // made smaller (or can't be decoded).
+        static std::string optimize(const std::string& png);
+
+    private:
+        struct job {
+            std::string png;
+            callback done;
+        };
+        void work();
+
+        std::vector<std::thread> threads;
+        std::queue<job> jobs;
+        size_t max_jobs;
+        int active = 0;
+        bool stopping = false;
+        std::mutex jobs_mutex;
+        std::condition_variable jobs_cond;
+        std::condition_variable room_cond;
+        std::condition_variable idle_cond;
+};
+
+#endif // PNGOPTIMIZER_H
@@ -0,0 +1,206 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "renderworker.h"
+
+using std::string;
+using std::cerr;
+using std::endl;
+
+// Each worker can be sent a metatile's worth of tiles at a time, and can
+// be well ahead of the store sending tiles.
+static const size_t down_ring_size = 1 << 20;
+static const size_t up_ring_size = 16 << 20;
+
+enum : uint32_t {
+    // to the worker
+    msg_job,        // metatile header, then its pending tiles
+    msg_reply,      // one byte: whether the duplicate was stored
+    msg_stop,
+    // from the worker
+    msg_duplicate,  // tile, rawhash
+    msg_tile,       // tile, rawhash, then the encoded image
+    msg_solid,      // color of the whole metatile
+    msg_done,
+};
+
+struct job_header {
+    int32_t x, y, z, size;
+};
+
+struct tile_header {
+    tile t;
+    rawhash raw;
+};
+
+WorkerChannel::WorkerChannel()
+    : down(ShmRing::create(down_ring_size)), up(ShmRing::create(up_ring_size))
+{
+}
+
+bool WorkerChannel::alive()
+{
+    if (exited)
+        return false;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != pid)
+        return true;
+    exited = true;
+    if (WIFSIGNALED(status))
+        cerr << "Render worker " << pid << " was killed by signal " << WTERMSIG(status) << endl;
+    else
+        cerr << "Render worker " << pid << " exited with status " << WEXITSTATUS(status) << endl;
+    return false;
+}
+
+bool WorkerChannel::render(const metatile &mt, const std::vector<tile> &pending, TileStore &store,
+                           const std::function<void(uint32_t)> &solid)
+{
+    auto is_alive = [this]() { return alive(); };
+    job_header job { mt.x, mt.y, mt.z, mt.size };
+    if (!down->send(msg_job, &job, sizeof(job), pending.data(), pending.size() * sizeof(tile), is_alive))
+        return false;
+
+    uint32_t type;
+    string payload;
+    while (up->receive(type, payload, is_alive)) {
+        tile_header h;
+        switch (type) {
+        case msg_duplicate: {
+            memcpy(&h, payload.data(), sizeof(h));
+            char stored = store.storeDuplicate(h.t, h.raw);
+            if (!down->send(msg_reply, &stored, 1, nullptr, 0, is_alive))
+                return false;
+            break;
+        }
+        case msg_tile:
+            memcpy(&h, payload.data(), sizeof(h));
+            payload.erase(0, sizeof(h));
+            store.storeTile(h.t, std::move(payload), h.raw);
+            payload = string();
+            break;
+        case msg_solid: {
+            uint32_t color;
+            memcpy(&color, payload.data(), sizeof(color));
+            solid(color);
+            break;
+        }
+        case msg_done:
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkerChannel::stop()
+{
+    if (exited)
+        return;
+    down->send(msg_stop, nullptr, 0, nullptr, 0, [this]() { return alive(); });
+    int status;
+    if (!exited)
+        waitpid(pid, &status, 0);
+    exited = true;
+}
+
+bool WorkerChannel::next(metatile &mt, std::vector<tile> &pending)
+{
+    uint32_t type;
+    string payload;
+    if (!down->receive(type, payload) || type != msg_job)
+        return false;
+    job_header job;
+    memcpy(&job, payload.data(), sizeof(job));
+    pending.resize((payload.size() - sizeof(job)) / sizeof(tile));
+    memcpy(pending.data(), payload.data() + sizeof(job), pending.size() * sizeof(tile));
+    mt = metatile { job.x, job.y, job.z, job.size, pending.cbegin(), pending.cend() };
+    return true;
+}
+
+bool WorkerChannel::duplicate(const tile &t, const rawhash &raw)
+{
+    tile_header h { t, raw };
+    up->send(msg_duplicate, &h, sizeof(h));
+    uint32_t type;
+    string payload;
+    return down->receive(type, payload) && type == msg_reply && payload[0];
+}
+
+void WorkerChannel::store(const tile &t, const rawhash &raw, const string &data)
+{
+    tile_header h { t, raw };
+    if (!up->send(msg_tile, &h, sizeof(h), data.data(), data.size()))
+        cerr << "Tile " << t << " is too big (" << data.size() << " bytes) to be sent" << endl;
+}
+
+void WorkerChannel::solid(uint32_t color)
+{
+    up->send(msg_solid, &color, sizeof(color));
+}
+
+void WorkerChannel::done()
+{
+    up->send(msg_done, nullptr, 0);
+}
+
+bool WorkerStore::storeDuplicate(const tile &t, const rawhash &raw)
+{
+    return channel.duplicate(t, raw);
+}
+
+void WorkerStore::storeTile(const tile &t, string &&data, const rawhash &raw)
+{
+    channel.store(t, raw, data);
+}
+
+RenderWorkers::RenderWorkers(int count, const work_function &work)
+{
+    for (int i=0; i<count; i++)
+        channels.emplace_back(new WorkerChannel());
+
+    pid_t parent = getpid();
+    std::cout.flush();
+    for (int i=0; i<count; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::system_error(errno, std::system_category(), "Error starting render worker");
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != parent)
+                _exit(1);
+            work(i, *channels[i]);
+            std::cout.flush();
+            std::cerr.flush();
+            // none of the main process' cleanup is for us
+            _exit(0);
+        }
+        channels[i]->pid = pid;
+    }
+}
+
+RenderWorkers::~RenderWorkers()
+{
+    for (auto& c: channels)
+        c->stop();
+}
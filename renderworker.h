@@ -0,0 +1,107 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef RENDERWORKER_H
+#define RENDERWORKER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/types.h>
+
+#include "tilestore.h"
+#include "scheduler.h"
+#include "shmring.h"
+
+/* The two rings between the main process and one render worker (see
+ * --processes), and what goes through them.
+ *
+ * The main process keeps the store, the scheduler and the solid tiles
+ * index; for each metatile it sends the worker the tiles still to be
+ * stored. The worker renders them and, for each tile, asks whether its
+ * pixels are already stored (storeDuplicate, answered by the store) and
+ * if not, sends it encoded. Dedup and the store stay in one place, as
+ * with render threads.
+ */
+class WorkerChannel {
+    public:
+        WorkerChannel();
+
+        // Main process side. Has the worker render pending, the tiles of
+        // mt to be stored, answering its questions and storing what it
+        // sends. solid is called if the whole metatile came out as one
+        // color. Returns false if the worker has died.
+        bool render(const metatile& mt, const std::vector<tile>& pending, TileStore& store,
+                    const std::function<void(uint32_t)>& solid);
+        // Tells the worker to exit, and waits until it does.
+        void stop();
+
+        // Worker side. Waits for the next metatile; false means exit.
+        // mt's tiles point into pending.
+        bool next(metatile& mt, std::vector<tile>& pending);
+        bool duplicate(const tile& t, const rawhash& raw);
+        void store(const tile& t, const rawhash& raw, const std::string& data);
+        void solid(uint32_t color);
+        void done();
+
+    private:
+        friend class RenderWorkers;
+        bool alive();
+
+        ShmRing *down;  // to the worker
+        ShmRing *up;    // from the worker
+        pid_t pid = 0;
+        bool exited = false;
+};
+
+// In a worker, stands for the main process' store.
+class WorkerStore : public TileStore {
+    public:
+        WorkerStore(WorkerChannel& channel) : channel(channel) {}
+        // the main process only sends the tiles still to be rendered
+        bool alreadyRendered(const tile&) override { return false; }
+        bool storeDuplicate(const tile& t, const rawhash& raw) override;
+        void storeTile(const tile& t, std::string&& data, const rawhash& raw) override;
+        int unique_tiles() override { return 0; }
+
+    protected:
+        bool storeExisting(const tile&, const stored_image&) override { return false; }
+
+    private:
+        WorkerChannel& channel;
+};
+
+/* Forks the render workers. Fork before starting any threads: a worker
+ * only gets a copy of the thread that forked it, and of whatever locks
+ * the others were holding.
+ */
+class RenderWorkers {
+    public:
+        typedef std::function<void(int index, WorkerChannel& channel)> work_function;
+
+        // Starts count processes, each running work and exiting when it
+        // returns. Workers are killed if the main process dies.
+        RenderWorkers(int count, const work_function& work);
+        // Stops the workers still running and waits for them.
+        ~RenderWorkers();
+        WorkerChannel& channel(int index) { return *channels[index]; }
+
+    private:
+        std::vector<std::unique_ptr<WorkerChannel>> channels;
+};
+
+#endif // RENDERWORKER_H
@@ -0,0 +1,192 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+
+#include "hilbert.h"
+#include "scheduler.h"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::lock_guard;
+using std::unique_lock;
+using std::mutex;
+
+// Groups the (sorted) tiles into blocks of size x size tiles. The size is
+// a power of two, so blocks tile the world exactly; near the top of the
+// pyramid a block can't be larger than the world, so it's clamped to 2^z.
+static void make_metatiles(batch& b, int size)
+{
+    std::sort(b.tiles.begin(), b.tiles.end(), [size](const tile& a, const tile& b) {
+        if (a.z != b.z) return a.z < b.z;
+        if (a.x / size != b.x / size) return a.x / size < b.x / size;
+        if (a.y / size != b.y / size) return a.y / size < b.y / size;
+        if (a.x != b.x) return a.x < b.x;
+        return a.y < b.y;
+    });
+
+    auto i = b.tiles.cbegin();
+    while (i != b.tiles.cend()) {
+        metatile mt;
+        mt.z = i->z;
+        mt.size = std::min<long>(size, 1L << i->z);
+        mt.x = i->x / mt.size * mt.size;
+        mt.y = i->y / mt.size * mt.size;
+        mt.begin = i;
+        while (i != b.tiles.cend() && i->z == mt.z &&
+               i->x / mt.size * mt.size == mt.x &&
+               i->y / mt.size * mt.size == mt.y)
+            ++i;
+        mt.end = i;
+        b.metatiles.push_back(mt);
+    }
+}
+
+// Decides the order in which metatiles are rendered. With "hilbert" the
+// metatiles are sorted along a Hilbert curve (per zoom level) and cut into
+// runs, so each thread works on neighbouring tiles and datasource buffers,
+// the page cache and mapnik's caches stay warm. The runs themselves are
+// shuffled, so the progress loop keeps sampling all over the map and the
+// ETA stays as stable as with a full shuffle. With "shuffle" the order
+// is completely random (and the scheduler uses runs of a single metatile).
+//
+// We intentionally won't seed the shuffle, so that if you interrupt a
+// run, the next one will skip all the already rendered tiles first,
+// since the random order will be the same.
+//
+// Coarse to fine, runs don't span zoom levels and are ordered by level
+// (they're still shuffled within each level).
+static void make_runs(batch& b, const string& order, int run_length, bool coarse_to_fine)
+{
+    if (order == "shuffle") {
+        std::random_shuffle(b.metatiles.begin(), b.metatiles.end());
+    } else {
+        std::sort(b.metatiles.begin(), b.metatiles.end(), [](const metatile& a, const metatile& b) {
+            if (a.z != b.z) return a.z < b.z;
+            return hilbert_index(a.z, a.x, a.y) < hilbert_index(b.z, b.x, b.y);
+        });
+    }
+
+    if (!coarse_to_fine) {
+        for (size_t i = 0; i < b.metatiles.size(); i += run_length)
+            b.run_starts.push_back(i);
+
+        if (order != "shuffle")
+            std::random_shuffle(b.run_starts.begin(), b.run_starts.end());
+        return;
+    }
+
+    if (order == "shuffle") {
+        std::stable_sort(b.metatiles.begin(), b.metatiles.end(), [](const metatile& a, const metatile& b) {
+            return a.z < b.z;
+        });
+    }
+    size_t i = 0;
+    while (i < b.metatiles.size()) {
+        size_t level = b.run_starts.size();
+        int z = b.metatiles[i].z;
+        for (int n = 0; i < b.metatiles.size() && b.metatiles[i].z == z; i++, n++) {
+            if (n % run_length == 0) {
+                b.run_starts.push_back(i);
+                b.level_starts.push_back(level);
+            }
+        }
+        if (order != "shuffle")
+            std::random_shuffle(b.run_starts.begin() + level, b.run_starts.end());
+    }
+}
+
+Scheduler::Scheduler(TileSource &source, int metatile_size, const string &order,
+                     int run_length, size_t window, bool coarse_to_fine)
+    : source(source), metatile_size(metatile_size), order(order),
+      run_length(run_length), window(window), coarse_to_fine(coarse_to_fine)
+{
+    if (order == "shuffle")
+        this->run_length = 1;
+    current = load_batch();
+}
+
+shared_ptr<batch> Scheduler::load_batch()
+{
+    shared_ptr<batch> b = std::make_shared<batch>();
+    b->tiles.reserve(window);
+    if (!source.read(b->tiles, window))
+        return nullptr;
+
+    make_metatiles(*b, metatile_size);
+    make_runs(*b, order, run_length, coarse_to_fine);
+    return b;
+}
+
+// Called when a thread finds the batch it was working on exhausted. The
+// first thread to get here loads the next window; the rest just pick up
+// the new batch.
+shared_ptr<batch> Scheduler::advance(const shared_ptr<batch> &exhausted)
+{
+    lock_guard<mutex> lock(current_mutex);
+    if (current && current == exhausted)
+        current = load_batch();
+    return current;
+}
+
+void Scheduler::complete(run &r)
+{
+    {
+        lock_guard<mutex> lock(r.owner->completed_mutex);
+        r.owner->completed++;
+    }
+    r.owner->completed_cond.notify_all();
+    r.tracked = false;
+}
+
+bool Scheduler::next(run &r)
+{
+    if (r.tracked)
+        complete(r);
+
+    shared_ptr<batch> b = r.owner;
+    if (!b) {
+        lock_guard<mutex> lock(current_mutex);
+        b = current;
+    }
+
+    while (b) {
+        size_t i = b->next_run.fetch_add(1, std::memory_order_relaxed);
+        if (i < b->run_starts.size()) {
+            if (coarse_to_fine) {
+                // runs are handed out in order, so once as many runs as
+                // there are before this level are done, they all are
+                unique_lock<mutex> lock(b->completed_mutex);
+                size_t level = b->level_starts[i];
+                b->completed_cond.wait(lock, [&b, level]() { return b->completed >= level; });
+                r.tracked = true;
+            }
+            size_t start = b->run_starts[i];
+            size_t end = std::min(start + run_length, b->metatiles.size());
+            // the last run of a level is usually shorter
+            while (coarse_to_fine && b->metatiles[end - 1].z != b->metatiles[start].z)
+                end--;
+            r.begin = b->metatiles.cbegin() + start;
+            r.end = b->metatiles.cbegin() + end;
+            r.owner = b;
+            return true;
+        }
+        b = advance(b);
+    }
+    r.owner.reset();
+    return false;
+}
@@ -0,0 +1,109 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <condition_variable>
+#include <vector>
+
+#include "tilestore.h"
+#include "tilesource.h"
+
+// A block of size x size tiles, rendered as a single image and then sliced.
+// Only the tiles in [begin, end) were requested in the input; the rest of
+// the block is rendered (it's part of the image) but never stored.
+struct metatile {
+    int x;
+    int y;
+    int z;
+    int size;
+    std::vector<tile>::const_iterator begin;
+    std::vector<tile>::const_iterator end;
+};
+
+struct batch;
+
+// A stretch of consecutive metatiles handed to a render thread at once.
+// It keeps the batch it points into alive.
+struct run {
+    std::vector<metatile>::const_iterator begin;
+    std::vector<metatile>::const_iterator end;
+    std::shared_ptr<batch> owner;
+    // the batch waits for this run to finish before starting finer levels
+    bool tracked = false;
+};
+
+// A window of the input: its tiles grouped into metatiles and cut into
+// runs. It is never modified once built, so runs are handed out by just
+// bumping an index.
+struct batch {
+    std::vector<tile> tiles;
+    std::vector<metatile> metatiles;
+    std::vector<size_t> run_starts;
+    std::atomic<size_t> next_run { 0 };
+
+    // Only used when scheduling coarse to fine: for each run, the index of
+    // the first run of its zoom level, and how many runs are done.
+    std::vector<size_t> level_starts;
+    size_t completed = 0;
+    std::mutex completed_mutex;
+    std::condition_variable completed_cond;
+};
+
+/* Reads the tile source a window at a time and hands out runs of
+ * metatiles to the render threads. Only the window being rendered (and
+ * the one before it, while its last runs finish) are kept in memory.
+ *
+ * Metatiles are built within a window, so a block whose tiles end up in
+ * different windows is rendered once per window.
+ *
+ * With coarse_to_fine, the runs of a window are handed out one zoom level
+ * at a time: no run of level z starts until every run of the levels above
+ * it is finished, so results for parent tiles are known before rendering
+ * their children (see --prune-solid).
+ */
+class Scheduler {
+    public:
+        Scheduler(TileSource& source, int metatile_size, const std::string& order,
+                  int run_length, size_t window, bool coarse_to_fine = false);
+        // Replaces r with the next run to render. Pass the same run
+        // object on every call; it caches the current batch, so the
+        // common case needs a single atomic increment.
+        bool next(run& r);
+        long total() { return source.total(); }
+
+    private:
+        std::shared_ptr<batch> advance(const std::shared_ptr<batch>& exhausted);
+        std::shared_ptr<batch> load_batch();
+        void complete(run& r);
+
+        TileSource& source;
+        int metatile_size;
+        std::string order;
+        int run_length;
+        size_t window;
+        bool coarse_to_fine;
+
+        std::mutex current_mutex;
+        std::shared_ptr<batch> current;
+};
+
+#endif // SCHEDULER_H
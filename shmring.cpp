@@ -0,0 +1,148 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <new>
+#include <ctime>
+#include <cstring>
+#include <system_error>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+using std::string;
+
+// messages start with their type and payload size, and are padded to
+// 8 bytes
+struct message_header {
+    uint32_t type;
+    uint32_t size;
+};
+
+static uint64_t padded(uint64_t size)
+{
+    return (size + 7) & ~uint64_t(7);
+}
+
+ShmRing *ShmRing::create(size_t capacity)
+{
+    capacity = padded(capacity);
+    size_t header = padded(sizeof(ShmRing));
+    void *p = mmap(nullptr, header + capacity, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "Error mapping shared memory");
+    ShmRing *ring = new (p) ShmRing();
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->head_seq = 0;
+    ring->tail_seq = 0;
+    ring->reader_waiting = 0;
+    ring->writer_waiting = 0;
+    // the same address in both processes, since they fork after this
+    ring->data = static_cast<char *>(p) + header;
+    return ring;
+}
+
+void ShmRing::copy_in(uint64_t pos, const void *src, size_t size)
+{
+    size_t at = pos % capacity;
+    size_t first = std::min(size, size_t(capacity - at));
+    memcpy(data + at, src, first);
+    memcpy(data, static_cast<const char *>(src) + first, size - first);
+}
+
+void ShmRing::copy_out(uint64_t pos, void *dst, size_t size)
+{
+    size_t at = pos % capacity;
+    size_t first = std::min(size, size_t(capacity - at));
+    memcpy(dst, data + at, first);
+    memcpy(static_cast<char *>(dst) + first, data, size - first);
+}
+
+// Sleeps until seq moves from seen. The waiting flag is raised before
+// looking at seq again, so a wake from the other side can't be missed.
+bool ShmRing::wait(std::atomic<uint32_t>& seq, uint32_t seen,
+                   std::atomic<uint32_t>& waiting, const std::function<bool()>& alive)
+{
+    waiting.store(1);
+    if (seq.load() == seen) {
+        struct timespec timeout { 0, 100 * 1000 * 1000 };
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq), FUTEX_WAIT, seen,
+                &timeout, nullptr, 0);
+    }
+    waiting.store(0);
+    return !alive || seq.load() != seen || alive();
+}
+
+void ShmRing::wake(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting)
+{
+    seq.fetch_add(1);
+    if (waiting.load())
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq), FUTEX_WAKE, 1,
+                nullptr, nullptr, 0);
+}
+
+bool ShmRing::send(uint32_t type, const void *part1, size_t size1,
+                   const void *part2, size_t size2, const std::function<bool()>& alive)
+{
+    uint64_t size = padded(sizeof(message_header) + size1 + size2);
+    if (size > capacity)
+        return false;
+
+    uint64_t h = head.load(std::memory_order_relaxed);
+    while (true) {
+        uint32_t seen = tail_seq.load();
+        if (capacity - (h - tail.load(std::memory_order_acquire)) >= size)
+            break;
+        if (!wait(tail_seq, seen, writer_waiting, alive))
+            return false;
+    }
+
+    message_header m { type, uint32_t(size1 + size2) };
+    copy_in(h, &m, sizeof(m));
+    copy_in(h + sizeof(m), part1, size1);
+    if (size2 > 0)
+        copy_in(h + sizeof(m) + size1, part2, size2);
+    head.store(h + size, std::memory_order_release);
+    wake(head_seq, reader_waiting);
+    return true;
+}
+
+bool ShmRing::receive(uint32_t& type, string& payload, const std::function<bool()>& alive)
+{
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    while (true) {
+        uint32_t seen = head_seq.load();
+        if (head.load(std::memory_order_acquire) != t)
+            break;
+        if (!wait(head_seq, seen, reader_waiting, alive))
+            return false;
+    }
+
+    message_header m;
+    copy_out(t, &m, sizeof(m));
+    type = m.type;
+    payload.resize(m.size);
+    if (m.size > 0)
+        copy_out(t + sizeof(m), &payload[0], m.size);
+    tail.store(t + padded(sizeof(m) + m.size), std::memory_order_release);
+    wake(tail_seq, writer_waiting);
+    return true;
+}
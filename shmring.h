@@ -0,0 +1,71 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <functional>
+
+/* A queue of messages between two processes, for one writer and one
+ * reader: a ring buffer in a shared anonymous mapping, created before
+ * forking. Each message is a type and a payload, copied in and out.
+ *
+ * Neither side takes a lock. A side that finds the ring empty (or full)
+ * sleeps on a futex until the other one moves, waking up every 100ms to
+ * ask alive() whether the other process is still there.
+ */
+class ShmRing {
+    public:
+        // Maps a ring with room for capacity bytes of messages; it's never
+        // unmapped, both processes use it until they exit.
+        static ShmRing *create(size_t capacity);
+
+        // Waits for room and appends a message made of two parts (e.g. a
+        // header and some data). Returns false if alive() says the reader
+        // is gone, or if the message can never fit.
+        bool send(uint32_t type, const void *part1, size_t size1,
+                  const void *part2 = nullptr, size_t size2 = 0,
+                  const std::function<bool()>& alive = nullptr);
+        // Waits for a message. Returns false if alive() says the writer is
+        // gone.
+        bool receive(uint32_t& type, std::string& payload,
+                     const std::function<bool()>& alive = nullptr);
+
+    private:
+        ShmRing() {}
+        void copy_in(uint64_t pos, const void *data, size_t size);
+        void copy_out(uint64_t pos, void *data, size_t size);
+        static bool wait(std::atomic<uint32_t>& seq, uint32_t seen,
+                         std::atomic<uint32_t>& waiting, const std::function<bool()>& alive);
+        static void wake(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting);
+
+        uint64_t capacity;
+        // bytes ever written and read; only their writer changes them
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> tail;
+        // futex words, bumped after head and tail move
+        std::atomic<uint32_t> head_seq;
+        std::atomic<uint32_t> tail_seq;
+        std::atomic<uint32_t> reader_waiting;
+        std::atomic<uint32_t> writer_waiting;
+        char *data;
+};
+
+#endif // SHMRING_H
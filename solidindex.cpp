@@ -0,0 +1,45 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "solidindex.h"
+
+// Tiles are numbered level after level, like PMTiles tile ids (with rows
+// instead of the Hilbert curve), which takes under 64 bits down to zoom
+// level 31.
+uint64_t SolidIndex::key(int z, int x, int y)
+{
+    uint64_t level_start = ((uint64_t(1) << (2 * z)) - 1) / 3;
+    return level_start + (uint64_t(x) << z) + uint64_t(y);
+}
+
+void SolidIndex::insert(const tile &t, uint32_t color)
+{
+    tiles.insert(key(t.z, t.x, t.y), color);
+    zooms.fetch_or(1u << t.z, std::memory_order_release);
+}
+
+bool SolidIndex::find(const tile &t, uint32_t &color)
+{
+    uint32_t z = zooms.load(std::memory_order_acquire);
+    for (int a = 0; a < t.z; a++) {
+        if (!(z & (1u << a)))
+            continue;
+        int shift = t.z - a;
+        if (tiles.find(key(a, t.x >> shift, t.y >> shift), color))
+            return true;
+    }
+    return false;
+}
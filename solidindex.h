@@ -0,0 +1,45 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SOLIDINDEX_H
+#define SOLIDINDEX_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "tilestore.h"
+#include "digestmap.h"
+
+/* Tiles that rendered as a single color, buffer included. Every tile
+ * under one of them, at deeper zoom levels, will render as that same
+ * color (as long as the layers allow it; see --prune-layers) so there's
+ * no need to render them.
+ */
+class SolidIndex {
+    public:
+        void insert(const tile& t, uint32_t color);
+        // Looks for a solid ancestor of t, at a coarser zoom level.
+        bool find(const tile& t, uint32_t& color);
+
+    private:
+        static uint64_t key(int z, int x, int y);
+
+        DigestMap<uint64_t,uint32_t> tiles;
+        // zoom levels with any solid tiles, so find only looks at those
+        std::atomic<uint32_t> zooms { 0 };
+};
+
+#endif // SOLIDINDEX_H
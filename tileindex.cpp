@@ -0,0 +1,100 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+
+#include "tileindex.h"
+
+// Past this many entries an array takes as much memory as a bitmap.
+#define ARRAY_MAX 4096
+
+TileIndex::TileIndex()
+    : levels(32), counts(32, 0)
+{
+}
+
+static uint64_t block_key(const tile& t)
+{
+    return (uint64_t(uint32_t(t.x) >> 8) << 32) | (uint32_t(t.y) >> 8);
+}
+
+static uint16_t block_offset(const tile& t)
+{
+    return ((t.x & 0xff) << 8) | (t.y & 0xff);
+}
+
+bool TileIndex::block::insert(uint16_t offset)
+{
+    if (!bitmap.empty()) {
+        uint64_t bit = uint64_t(1) << (offset & 63);
+        if (bitmap[offset >> 6] & bit)
+            return false;
+        bitmap[offset >> 6] |= bit;
+        return true;
+    }
+
+    // tiles usually come in order, so appending is the common case
+    if (array.empty() || array.back() < offset) {
+        array.push_back(offset);
+    } else {
+        auto i = std::lower_bound(array.begin(), array.end(), offset);
+        if (*i == offset)
+            return false;
+        array.insert(i, offset);
+    }
+
+    if (array.size() > ARRAY_MAX) {
+        bitmap.assign(65536 / 64, 0);
+        for (uint16_t v: array)
+            bitmap[v >> 6] |= uint64_t(1) << (v & 63);
+        std::vector<uint16_t>().swap(array);
+    }
+    return true;
+}
+
+bool TileIndex::block::contains(uint16_t offset) const
+{
+    if (!bitmap.empty())
+        return bitmap[offset >> 6] & (uint64_t(1) << (offset & 63));
+    return std::binary_search(array.begin(), array.end(), offset);
+}
+
+void TileIndex::insert(const tile &t)
+{
+    if (t.z < 0 || t.z >= int(levels.size()))
+        return;
+    if (levels[t.z][block_key(t)].insert(block_offset(t)))
+        counts[t.z]++;
+}
+
+bool TileIndex::contains(const tile &t) const
+{
+    if (t.z < 0 || t.z >= int(levels.size()))
+        return false;
+    const level& l = levels[t.z];
+    auto i = l.find(block_key(t));
+    if (i == l.end())
+        return false;
+    return i->second.contains(block_offset(t));
+}
+
+size_t TileIndex::size() const
+{
+    size_t r = 0;
+    for (size_t c: counts)
+        r += c;
+    return r;
+}
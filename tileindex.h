@@ -0,0 +1,57 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TILEINDEX_H
+#define TILEINDEX_H
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+#include "tilestore.h"
+
+/* A compact set of tiles, used to know which tiles are already rendered.
+ *
+ * Each zoom level is split in blocks of 256x256 tiles and each block is
+ * stored roaring-style: a sorted array of 16 bit offsets while it's
+ * sparse, a 65536 bit bitmap once it's dense. That's between 2 bytes and
+ * 1 bit per tile, for any zoom level up to 31.
+ *
+ * Lookups are safe from any number of threads as long as nobody inserts.
+ * Inserts into different zoom levels may run concurrently; inserts into
+ * the same level must be serialized.
+ */
+class TileIndex {
+    public:
+        TileIndex();
+        void insert(const tile& t);
+        bool contains(const tile& t) const;
+        size_t size() const;
+
+    private:
+        struct block {
+            std::vector<uint16_t> array;
+            std::vector<uint64_t> bitmap;
+            bool insert(uint16_t offset);
+            bool contains(uint16_t offset) const;
+        };
+        typedef std::unordered_map<uint64_t, block> level;
+
+        std::vector<level> levels;
+        std::vector<size_t> counts;
+};
+
+#endif // TILEINDEX_H
@@ -0,0 +1,271 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "tilesource.h"
+
+using std::string;
+using std::vector;
+
+static const char quadkey_magic[8] = { 'A', 'T', 'R', 'Q', 'K', '1', '\n', '\0' };
+
+MappedFile::MappedFile(const string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Error opening " + filename + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Error reading " + filename + ": " + strerror(errno));
+    }
+    size = st.st_size;
+
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Error mapping " + filename + ": " + strerror(errno));
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(p);
+    }
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data)
+        munmap(const_cast<char *>(data), size);
+}
+
+// Parses an unsigned decimal number; returns nullptr if there's none at p.
+static const char *parse_int(const char *p, const char *end, int &value)
+{
+    const char *start = p;
+    long v = 0;
+    while (p < end && *p >= '0' && *p <= '9' && v <= 0x7fffffff) {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    if (p == start || v > 0x7fffffff)
+        return nullptr;
+    value = int(v);
+    return p;
+}
+
+// Parses a single "Z/X/Y" line starting at p. On success returns the start
+// of the next line; returns nullptr on syntax errors. Blank lines set
+// t.z to -1.
+static const char *parse_line(const char *p, const char *end, tile &t)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    if (p == end || *p == '\n' || *p == '\r') {
+        t.z = -1;
+    } else {
+        if (!(p = parse_int(p, end, t.z)) || p == end || *p++ != '/')
+            return nullptr;
+        if (!(p = parse_int(p, end, t.x)) || p == end || *p++ != '/')
+            return nullptr;
+        if (!(p = parse_int(p, end, t.y)))
+            return nullptr;
+        if (t.z > 31)
+            return nullptr;
+    }
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    if (p < end && *p++ != '\n')
+        return nullptr;
+    return p;
+}
+
+TextTileSource::TextTileSource(const string &filename)
+    : file(filename), pos(file.begin())
+{
+    const char *p = file.begin();
+    tile t;
+    while (p < file.end()) {
+        const char *next = parse_line(p, file.end(), t);
+        if (next == nullptr) {
+            const char *eol = static_cast<const char *>(memchr(p, '\n', file.end() - p));
+            throw std::runtime_error(
+                "error parsing line: " + string(p, eol ? eol : file.end()) + "\n"
+                "input lines must be in Z/X/Y format");
+        }
+        if (t.z >= 0)
+            count++;
+        p = next;
+    }
+}
+
+bool TextTileSource::read(vector<tile> &out, size_t max)
+{
+    size_t n = 0;
+    tile t;
+    while (n < max && pos < file.end()) {
+        // the file was validated by the constructor
+        pos = parse_line(pos, file.end(), t);
+        if (t.z >= 0) {
+            out.push_back(t);
+            n++;
+        }
+    }
+    return n > 0;
+}
+
+static uint64_t load_quadkey(const char *p)
+{
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(p);
+    uint64_t key = 0;
+    for (int i=7; i>=0; i--)
+        key = (key << 8) | b[i];
+    return key;
+}
+
+// The leading 1 bit must be there, at an even position
+static bool valid_quadkey(uint64_t key)
+{
+    return key != 0 && (63 - __builtin_clzll(key)) % 2 == 0;
+}
+
+QuadkeyTileSource::QuadkeyTileSource(const string &filename)
+    : file(filename), pos(file.begin() + sizeof(quadkey_magic))
+{
+    size_t size = file.end() - file.begin();
+    if (size < sizeof(quadkey_magic) ||
+            memcmp(file.begin(), quadkey_magic, sizeof(quadkey_magic)) != 0)
+        throw std::runtime_error(filename + " is not a quadkey tile list");
+    if ((size - sizeof(quadkey_magic)) % 8 != 0)
+        throw std::runtime_error(filename + " is truncated");
+    count = (size - sizeof(quadkey_magic)) / 8;
+
+    for (const char *p = pos; p < file.end(); p += 8) {
+        if (!valid_quadkey(load_quadkey(p))) {
+            std::ostringstream msg;
+            msg << filename << " is corrupt: invalid quadkey at byte " << (p - file.begin());
+            throw std::runtime_error(msg.str());
+        }
+    }
+}
+
+bool QuadkeyTileSource::read(vector<tile> &out, size_t max)
+{
+    size_t n = 0;
+    while (n < max && pos < file.end()) {
+        // the keys were validated by the constructor
+        out.push_back(quadkey2tile(load_quadkey(pos)));
+        pos += 8;
+        n++;
+    }
+    return n > 0;
+}
+
+// Spreads the 32 bits of v over the even bits of the result.
+static uint64_t spread_bits(uint64_t v)
+{
+    v &= 0xffffffff;
+    v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+    v = (v | (v << 8))  & 0x00ff00ff00ff00ffULL;
+    v = (v | (v << 4))  & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v << 2))  & 0x3333333333333333ULL;
+    v = (v | (v << 1))  & 0x5555555555555555ULL;
+    return v;
+}
+
+// Inverse of spread_bits: gathers the even bits of v.
+static uint32_t gather_bits(uint64_t v)
+{
+    v &= 0x5555555555555555ULL;
+    v = (v | (v >> 1))  & 0x3333333333333333ULL;
+    v = (v | (v >> 2))  & 0x0f0f0f0f0f0f0f0fULL;
+    v = (v | (v >> 4))  & 0x00ff00ff00ff00ffULL;
+    v = (v | (v >> 8))  & 0x0000ffff0000ffffULL;
+    v = (v | (v >> 16)) & 0x00000000ffffffffULL;
+    return uint32_t(v);
+}
+
+uint64_t tile2quadkey(const tile &t)
+{
+    return (uint64_t(1) << (2 * t.z)) | spread_bits(t.x) | (spread_bits(t.y) << 1);
+}
+
+tile quadkey2tile(uint64_t key)
+{
+    int z = (63 - __builtin_clzll(key)) / 2;
+    key &= ~(uint64_t(1) << (2 * z));
+    tile t;
+    t.x = gather_bits(key);
+    t.y = gather_bits(key >> 1);
+    t.z = z;
+    return t;
+}
+
+std::unique_ptr<TileSource> open_tile_source(const string &filename)
+{
+    char magic[sizeof(quadkey_magic)] = {};
+    std::ifstream f(filename, std::ios::binary);
+    if (!f)
+        throw std::runtime_error("Error opening " + filename + ": " + strerror(errno));
+    f.read(magic, sizeof(magic));
+    f.close();
+
+    if (memcmp(magic, quadkey_magic, sizeof(magic)) == 0)
+        return std::unique_ptr<TileSource>(new QuadkeyTileSource(filename));
+    return std::unique_ptr<TileSource>(new TextTileSource(filename));
+}
+
+void save_quadkeys(TileSource &source, const string &filename)
+{
+    std::ofstream o(filename, std::ios::binary | std::ios::trunc);
+    if (!o)
+        throw std::runtime_error("Error opening " + filename + " for writing: " + strerror(errno));
+    o.write(quadkey_magic, sizeof(quadkey_magic));
+
+    vector<tile> chunk;
+    vector<unsigned char> buf;
+    while (source.read(chunk, 1 << 16)) {
+        buf.clear();
+        for (const tile& t: chunk) {
+            if (uint64_t(t.x) >> t.z || uint64_t(t.y) >> t.z) {
+                std::ostringstream msg;
+                msg << "tile " << t << " can't be stored as a quadkey";
+                throw std::runtime_error(msg.str());
+            }
+            uint64_t key = tile2quadkey(t);
+            for (int i=0; i<8; i++)
+                buf.push_back((key >> (8 * i)) & 0xff);
+        }
+        o.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+        chunk.clear();
+    }
+    o.close();
+    if (!o)
+        throw std::runtime_error("Error writing " + filename);
+}
@@ -0,0 +1,103 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TILESOURCE_H
+#define TILESOURCE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "tilestore.h"
+
+/* A stream of tiles to render. Sources are read a chunk at a time so
+ * that huge tile lists never have to be held in memory at once.
+ */
+class TileSource {
+    public:
+        virtual ~TileSource() {}
+        // Appends up to max tiles to out. Returns false once the source
+        // is exhausted and nothing was appended.
+        virtual bool read(std::vector<tile>& out, size_t max) = 0;
+        // Number of tiles this source produces in total, or -1 if unknown.
+        virtual long total() = 0;
+};
+
+/* Memory-mapped file, released on destruction. */
+class MappedFile {
+    public:
+        MappedFile(const std::string& filename);
+        ~MappedFile();
+        const char *begin() const { return data; }
+        const char *end() const { return data + size; }
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        const char *data = nullptr;
+        size_t size = 0;
+};
+
+/* Z/X/Y lines, one tile per line (the output format of tilestache-list).
+ * The whole file is validated and counted when it's opened, so syntax
+ * errors are reported before rendering starts.
+ */
+class TextTileSource : public TileSource {
+    public:
+        TextTileSource(const std::string& filename);
+        bool read(std::vector<tile>& out, size_t max) override;
+        long total() override { return count; }
+
+    private:
+        MappedFile file;
+        const char *pos;
+        long count = 0;
+};
+
+/* Binary tile list: the 8 byte magic "ATRQK1\n\0" followed by one
+ * little-endian uint64 quadkey per tile (see tile2quadkey). The
+ * constructor checks every key, and throws if the file is corrupt.
+ */
+class QuadkeyTileSource : public TileSource {
+    public:
+        QuadkeyTileSource(const std::string& filename);
+        bool read(std::vector<tile>& out, size_t max) override;
+        long total() override { return count; }
+
+    private:
+        MappedFile file;
+        const char *pos;
+        long count = 0;
+};
+
+/* Quadkeys pack a tile into a single integer: the bits of x and y are
+ * interleaved (like the digits of a Bing quadkey) and a leading 1 bit
+ * above them marks the zoom level. Zoom levels up to 31 fit.
+ */
+uint64_t tile2quadkey(const tile& t);
+// key must be a valid quadkey: non-zero, with its leading bit at an even
+// position.
+tile quadkey2tile(uint64_t key);
+
+// Opens filename as a binary quadkey list if it starts with the magic,
+// or as a Z/X/Y text list otherwise. Throws std::runtime_error on errors.
+std::unique_ptr<TileSource> open_tile_source(const std::string& filename);
+
+// Writes every tile of source to filename in the binary quadkey format.
+void save_quadkeys(TileSource& source, const std::string& filename);
+
+#endif // TILESOURCE_H
@@ -19,6 +19,8 @@
 #include <fstream>
 
 #include "tilestore.h"
+#include "pngoptimizer.h"
+#include "coprocess.h"
 
 namespace fs = boost::filesystem;
 
@@ -44,12 +46,12 @@ string hexdigest(const unsigned char *digest)
     return r;
 }
 
-void TileStore::postprocess(const std::__cxx11::string &command)
+void TileStore::postprocess(const std::string &command)
 {
     postprocess_command = command;
 }
 
-void TileStore::tempdir(const std::__cxx11::string &tmpdir)
+void TileStore::tempdir(const std::string &tmpdir)
 {
     if (tmpdir.empty())
         _tempdir = fs::temp_directory_path();
@@ -57,13 +59,65 @@ void TileStore::tempdir(const std::__cxx11::string &tmpdir)
         _tempdir = tmpdir;
 }
 
-string TileStore::md5(const string &data)
+void TileStore::optimizer(std::shared_ptr<PngOptimizer> optimizer)
 {
-    unsigned char hash[16];
-    //mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_MD5),
-    mbedtls_md5(reinterpret_cast<const unsigned char*>(data.c_str()),data.size(),hash);
+    _optimizer = optimizer;
+}
+
+void TileStore::coprocesses(std::shared_ptr<CoprocessPool> pool)
+{
+    _coprocesses = pool;
+}
+
+bool TileStore::finished()
+{
+    return !_optimizer || _optimizer->idle();
+}
+
+string hexdigest(const md5digest &digest)
+{
+    return hexdigest(reinterpret_cast<const unsigned char*>(&digest));
+}
+
+md5digest TileStore::md5_digest(const string &data)
+{
+    md5digest digest;
+    mbedtls_md5(reinterpret_cast<const unsigned char*>(data.c_str()), data.size(),
+                reinterpret_cast<unsigned char*>(&digest));
+    return digest;
+}
+
+bool TileStore::storeDuplicate(const tile &t, const rawhash &raw)
+{
+    stored_image image;
+    if (!raw_hashes.find(raw, image))
+        return false;
+    return storeExisting(t, image);
+}
+
+void TileStore::remember(const rawhash &raw, const md5digest &digest, int id)
+{
+    raw_hashes.insert(raw, stored_image { digest, id });
+}
+
+void TileStore::process(string &&data, const string &hash, processed_callback done)
+{
+    if (_optimizer) {
+        _optimizer->submit(std::move(data), done);
+        return;
+    }
+    if (!_coprocesses && postprocess_command.empty()) {
+        done(std::move(data));
+        return;
+    }
 
-    return hexdigest(hash);
+    string d = _coprocesses ? _coprocesses->process(data)
+                            : do_postprocess(data, hash + ".png");
+    if (d.empty()) {
+        // We'll assume an empty result means an error
+        cerr << "Postprocessing " << hash << ".png yielded 0 bytes, not storing it" << endl;
+    }
+    done(std::move(d));
 }
 
 string TileStore::do_postprocess(const string &data, const string &filename)
@@ -20,9 +20,14 @@
 #include <memory>
 #include <iostream>
 #include <string>
+#include <functional>
 #include <mbedtls/md5.h>
 #include <boost/filesystem.hpp>
 
+#include "imageutil.h"
+#include "digestmap.h"
+#include "idmap.h"
+
 struct tile {
     int x;
     int y;
@@ -31,21 +36,60 @@ struct tile {
 
 std::ostream& operator<<(std::ostream& o, const tile& t);
 
+std::string hexdigest(const md5digest& digest);
+
+// An image already in a store: its MD5 and, if the store numbers its
+// images, its number. Kept inline, there's one per unique image.
+struct stored_image {
+    md5digest digest;
+    int id;
+};
+
+class PngOptimizer;
+class CoprocessPool;
+
 class TileStore {
     public:
         virtual bool alreadyRendered(const tile& t) = 0;
-        virtual void storeTile(const tile& t, std::string&& data) = 0;
+        virtual void storeTile(const tile& t, std::string&& data, const rawhash& raw) = 0;
+        // Stores t without encoding it, if an image with the same pixels
+        // has been stored already. Returns false otherwise.
+        virtual bool storeDuplicate(const tile& t, const rawhash& raw);
         virtual void close() {}
         virtual int unique_tiles() = 0;
-        virtual bool finished() { return true; }
+        virtual bool finished();
+        // For the progress output of stores with a --write-buffer: what's
+        // waiting in it (entries and bytes) and how long storing tiles has
+        // waited for room in it, in seconds. Other stores return false.
+        virtual bool write_queue(long& entries, size_t& bytes, double& stalled) const { return false; }
         void postprocess(const std::string& command);
         void tempdir(const std::string& tmpdir);
-        std::string md5(const std::string& data);
+        void optimizer(std::shared_ptr<PngOptimizer> optimizer);
+        void coprocesses(std::shared_ptr<CoprocessPool> pool);
+        md5digest md5_digest(const std::string& data);
 
     protected:
-        std::string do_postprocess(const std::string& data, const std::__cxx11::string &filename);
+        // Stores t as a copy of an already stored image.
+        virtual bool storeExisting(const tile& t, const stored_image& image) = 0;
+        // Records that the image with these pixels is stored under digest.
+        // Only call it once the image is safely stored: storeDuplicate
+        // relies on it.
+        void remember(const rawhash& raw, const md5digest& digest, int id = -1);
+
+        typedef std::function<void(std::string&&)> processed_callback;
+        // Postprocesses a unique image, either in-process on the optimizer
+        // pool (done is then called later, from a pool thread), on a
+        // coprocess, or with the postprocess command. done always gets
+        // called; an empty result
+        // means postprocessing failed and the image must not be stored.
+        void process(std::string&& data, const std::string& hash, processed_callback done);
+        std::string do_postprocess(const std::string& data, const std::string &filename);
         std::string postprocess_command;
         boost::filesystem::path _tempdir;
+        std::shared_ptr<PngOptimizer> _optimizer;
+        std::shared_ptr<CoprocessPool> _coprocesses;
+        // raw pixel hash -> the stored image
+        DigestMap<rawhash,stored_image> raw_hashes;
 };
 
 #endif // TILESTORE_H
@@ -0,0 +1,193 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <sys/mman.h>
+
+#include "writequeue.h"
+
+using std::string;
+using std::lock_guard;
+using std::unique_lock;
+
+namespace {
+
+struct record_header {
+    uint32_t size;      // of the whole record; 0 means the next one is at
+                        // the start of the buffer
+    int32_t id;
+    tile t;
+    uint32_t data_size;
+    uint32_t hash_size;
+};
+
+inline size_t align8(size_t n)
+{
+    return (n + 7) & ~size_t(7);
+}
+
+}
+
+// The ring starts at this size, or the capacity if it's smaller
+static const size_t initial_limit = 4 << 20;
+
+// The whole capacity is mapped at once, so records never move, but pages
+// only take memory once they're written to.
+WriteQueue::WriteQueue(size_t capacity)
+    : capacity(align8(capacity)), limit(std::min(this->capacity, initial_limit))
+{
+    if (this->capacity == 0)
+        return;
+    void *p = mmap(nullptr, this->capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "Error allocating the write buffer");
+    buffer = static_cast<char *>(p);
+}
+
+WriteQueue::~WriteQueue()
+{
+    if (buffer)
+        munmap(buffer, capacity);
+}
+
+// Doubles the ring (at least up to end) if it isn't the whole capacity yet
+bool WriteQueue::grow(size_t end)
+{
+    if (limit == capacity || end > capacity)
+        return false;
+    limit = std::min(capacity, std::max(end, 2 * limit));
+    return true;
+}
+
+// Records never wrap around: if one doesn't fit at the end of the ring,
+// it goes at the start and the gap is left unused. The ring only grows
+// while it isn't wrapped, so records being taken never see its end move.
+bool WriteQueue::find_room(size_t size, size_t &pos, size_t &gap)
+{
+    gap = 0;
+    if (records == 0) {
+        head = tail = used = 0;
+        pos = 0;
+        return size <= limit || grow(size);
+    }
+    if (head == tail)
+        return false;
+    if (head > tail) {
+        if (limit - head >= size || grow(head + size)) {
+            pos = head;
+            return true;
+        }
+        if (tail >= size) {
+            pos = 0;
+            gap = limit - head;
+            return true;
+        }
+        return false;
+    }
+    pos = head;
+    return tail - head >= size;
+}
+
+double WriteQueue::push(const tile &t, int id, const string &data, const string &hash)
+{
+    size_t size = align8(sizeof(record_header) + data.size() + hash.size());
+    if (size > capacity)
+        throw std::runtime_error("tile larger than the write buffer");
+
+    double waited = 0;
+    unique_lock<std::mutex> lock(mutex);
+    size_t pos, gap;
+    if (!find_room(size, pos, gap)) {
+        auto start = std::chrono::steady_clock::now();
+        room.wait(lock, [&]() { return find_room(size, pos, gap); });
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+        waited = d.count();
+    }
+
+    if (gap >= sizeof(record_header)) {
+        record_header jump {};
+        memcpy(&buffer[head], &jump, sizeof(jump));
+    }
+    record_header h;
+    h.size = size;
+    h.id = id;
+    h.t = t;
+    h.data_size = data.size();
+    h.hash_size = hash.size();
+    char *p = &buffer[pos];
+    memcpy(p, &h, sizeof(h));
+    memcpy(p + sizeof(h), data.data(), data.size());
+    memcpy(p + sizeof(h) + data.size(), hash.data(), hash.size());
+
+    head = pos + size;
+    used += gap + size;
+    records++;
+    return waited;
+}
+
+size_t WriteQueue::take(std::vector<InsertOp> &ops, size_t max)
+{
+    lock_guard<std::mutex> lock(mutex);
+    size_t n = std::min<size_t>(max, records - taken);
+    size_t p = taken > 0 ? taken_end : tail;
+    for (size_t i = 0; i < n; i++) {
+        record_header h;
+        if (limit - p >= sizeof(h))
+            memcpy(&h, &buffer[p], sizeof(h));
+        if (limit - p < sizeof(h) || h.size == 0) {
+            taken_bytes += limit - p;
+            p = 0;
+            memcpy(&h, &buffer[p], sizeof(h));
+        }
+        const char *data = &buffer[p + sizeof(h)];
+        ops.push_back(InsertOp {
+            h.t, h.id,
+            data, h.data_size,
+            data + h.data_size, h.hash_size
+        });
+        taken_bytes += h.size;
+        p += h.size;
+    }
+    taken += n;
+    taken_end = p;
+    return n;
+}
+
+void WriteQueue::release()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (taken == 0)
+            return;
+        tail = taken_end;
+        used -= taken_bytes;
+        records -= taken;
+        taken = taken_bytes = 0;
+    }
+    room.notify_all();
+}
+
+bool WriteQueue::empty()
+{
+    lock_guard<std::mutex> lock(mutex);
+    return records == 0;
+}
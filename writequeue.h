@@ -0,0 +1,85 @@
+// This file is part of ATRender, a fast & simple mapnik tile render
+// Copyright (C) 2016  Andy Teijelo <github.com/ateijelo>
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef WRITEQUEUE_H
+#define WRITEQUEUE_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+
+#include "tilestore.h"
+
+// A tile to write. New images come with their data and hash; for tiles
+// reusing an existing image data_size is 0.
+struct InsertOp {
+    tile t;
+    int id;
+    const char *data;
+    size_t data_size;
+    const char *hash;
+    size_t hash_size;
+};
+
+/* A bounded queue of tiles waiting for a single writer. Tiles, with their
+ * images, are copied into a ring buffer, so the queue never uses more
+ * memory than its capacity; push waits while it's full. The capacity is
+ * only reserved: the ring starts small and grows when it fills up, so
+ * memory is only used as far as the queue has actually reached.
+ *
+ * The writer takes a batch of records, writes them, and then releases
+ * them; only then is their space reused.
+ */
+class WriteQueue {
+    public:
+        WriteQueue(size_t capacity);
+        ~WriteQueue();
+        // Returns the time spent waiting for room, in seconds.
+        double push(const tile& t, int id, const std::string& data, const std::string& hash);
+        // Appends up to max records to ops. They stay valid until release().
+        size_t take(std::vector<InsertOp>& ops, size_t max);
+        void release();
+
+        bool empty();
+        size_t size() const { return records.load(std::memory_order_relaxed); }
+        size_t bytes() const { return used.load(std::memory_order_relaxed); }
+
+    private:
+        bool find_room(size_t size, size_t& pos, size_t& gap);
+        bool grow(size_t end);
+
+        size_t capacity;
+        char *buffer = nullptr;
+        size_t limit;    // the part of the buffer used so far
+        size_t head = 0; // where the next record goes
+        size_t tail = 0; // the oldest record
+        // only changed with the lock held; atomic so they can be displayed
+        std::atomic<size_t> used { 0 };
+        std::atomic<size_t> records { 0 };
+
+        size_t taken = 0;
+        size_t taken_bytes = 0;
+        size_t taken_end = 0;
+
+        std::mutex mutex;
+        std::condition_variable room;
+};
+
+#endif // WRITEQUEUE_H